@@ -0,0 +1,366 @@
+// Comparison of error context strategies, on the 'eval'/'div' scenario of the README
+// and on a deep parsing scenario, at error rates from 0% to 50%:
+//   diagctx       context pushed with diagctx::push_message(), rendered by the error handler
+//   nested        context added on errors with catch-and-rethrow (std::throw_with_nested)
+//   error_string  no exception, errors returned with a std::string accumulating the context
+// Each strategy produces the same error text. Reports throughput, p99 latency and peak heap usage
+// (bytes allocated through operator new, exception objects are not counted). Throughput and latency
+// are measured in separate passes, so that the throughput does not include a clock read per operation.
+// Build and run:
+//     g++ -std=c++17 -O2 diagctx.c benchmarks/bench_compare.cpp -o bench_compare && ./bench_compare --csv
+// Options of harness.hpp, and --ops=N for the number of operations per measurement (default: 200000).
+
+#include "../diagctx.hpp"
+#include "harness.hpp"
+
+#include <charconv>
+#include <exception>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/************ heap usage ************/
+
+namespace heap {
+std::size_t current = 0, peak = 0;
+}
+
+// The size is stored before each allocation, which GCC reports as out of bounds accesses.
+#pragma GCC diagnostic ignored "-Warray-bounds"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(std::size_t size) {
+    void* ptr = std::malloc(size + 16);
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    *static_cast<std::size_t*>(ptr) = size;
+    heap::current += size;
+    heap::peak = std::max(heap::peak, heap::current);
+    return static_cast<char*>(ptr) + 16;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr)
+        return;
+    char* base = static_cast<char*>(ptr) - 16;
+    heap::current -= *reinterpret_cast<std::size_t*>(base);
+    std::free(base);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+
+using namespace std::literals;
+using Message = diagctx::fixed_message<128>;
+
+int checksum = 0;
+std::size_t error_text_size = 0;
+
+void render_to_string(void* out, void* message) {
+    std::string& str = *static_cast<std::string*>(out);
+    str += message != nullptr ? static_cast<Message*>(message)->view() : "???"sv;
+    str += ": ";
+}
+
+std::string render_nested(std::exception const& e) {
+    std::string str = e.what();
+    try {
+        std::rethrow_if_nested(e);
+    } catch (std::exception const& inner) {
+        str += ": " + render_nested(inner);
+    }
+    return str;
+}
+
+int parse_int(std::string_view str, std::size_t& pos) {
+    int value = 0;
+    std::from_chars_result res = std::from_chars(str.data() + pos, str.data() + str.size(), value);
+    pos = res.ptr - str.data();
+    return value;
+}
+
+/************ eval/div, from the README ************/
+
+namespace eval_diagctx {
+int div(int a, int b) {
+    if (b == 0)
+        throw std::invalid_argument("div by zero");
+    return a / b;
+}
+
+int eval(std::string_view expr) {
+    unsigned msg_id = diagctx::push_message<128>("while evaluating '", expr, "'");
+    std::size_t pos = 0;
+    int a = parse_int(expr, pos);
+    char op = expr[pos++];
+    int b = parse_int(expr, pos);
+    int result;
+    switch (op) {
+    case '+': result = a + b; break;
+    case '/': result = div(a, b); break;
+    default: throw std::invalid_argument("unknown operation");
+    }
+    diagctx_pop(msg_id);
+    return result;
+}
+
+void run(std::string_view expr) {
+    try {
+        checksum += eval(expr);
+    } catch (std::exception const& e) {
+        std::string text;
+        diagctx_get(0, render_to_string, &text);
+        text += e.what();
+        error_text_size += text.size();
+    }
+}
+} // namespace eval_diagctx
+
+namespace eval_nested {
+int div(int a, int b) {
+    if (b == 0)
+        throw std::invalid_argument("div by zero");
+    return a / b;
+}
+
+int eval(std::string_view expr) {
+    std::size_t pos = 0;
+    int a = parse_int(expr, pos);
+    char op = expr[pos++];
+    int b = parse_int(expr, pos);
+    try {
+        switch (op) {
+        case '+': return a + b;
+        case '/': return div(a, b);
+        default: throw std::invalid_argument("unknown operation");
+        }
+    } catch (...) {
+        std::throw_with_nested(std::invalid_argument("while evaluating '" + std::string(expr) + "'"));
+    }
+}
+
+void run(std::string_view expr) {
+    try {
+        checksum += eval(expr);
+    } catch (std::exception const& e) {
+        error_text_size += render_nested(e).size();
+    }
+}
+} // namespace eval_nested
+
+namespace eval_error_string {
+bool div(int a, int b, int& result, std::string& error) {
+    if (b == 0) {
+        error = "div by zero";
+        return false;
+    }
+    result = a / b;
+    return true;
+}
+
+bool eval(std::string_view expr, int& result, std::string& error) {
+    std::size_t pos = 0;
+    int a = parse_int(expr, pos);
+    char op = expr[pos++];
+    int b = parse_int(expr, pos);
+    bool ok = true;
+    switch (op) {
+    case '+': result = a + b; break;
+    case '/': ok = div(a, b, result, error); break;
+    default: ok = false; error = "unknown operation"; break;
+    }
+    if (!ok)
+        error = "while evaluating '" + std::string(expr) + "': " + error;
+    return ok;
+}
+
+void run(std::string_view expr) {
+    int result;
+    std::string error;
+    if (eval(expr, result, error))
+        checksum += result;
+    else
+        error_text_size += error.size();
+}
+} // namespace eval_error_string
+
+/************ deep parsing: "n0/n1/.../n15", an invalid number is an error ************/
+
+constexpr int parse_depth = 16;
+
+namespace parse_diagctx {
+int parse(std::string_view doc, std::size_t pos, int level) {
+    unsigned msg_id = diagctx::push_message<128>("level ", level, " at offset ", pos);
+    std::size_t end = pos;
+    int value = parse_int(doc, end);
+    if (end == pos)
+        throw std::invalid_argument("invalid number");
+    if (level + 1 < parse_depth)
+        value += parse(doc, end + 1, level + 1);
+    diagctx_pop(msg_id);
+    return value;
+}
+
+void run(std::string_view doc) {
+    try {
+        checksum += parse(doc, 0, 0);
+    } catch (std::exception const& e) {
+        std::string text;
+        diagctx_get(0, render_to_string, &text);
+        text += e.what();
+        error_text_size += text.size();
+    }
+}
+} // namespace parse_diagctx
+
+namespace parse_nested {
+int parse(std::string_view doc, std::size_t pos, int level) {
+    try {
+        std::size_t end = pos;
+        int value = parse_int(doc, end);
+        if (end == pos)
+            throw std::invalid_argument("invalid number");
+        if (level + 1 < parse_depth)
+            value += parse(doc, end + 1, level + 1);
+        return value;
+    } catch (...) {
+        std::throw_with_nested(std::invalid_argument(
+            "level " + std::to_string(level) + " at offset " + std::to_string(pos)));
+    }
+}
+
+void run(std::string_view doc) {
+    try {
+        checksum += parse(doc, 0, 0);
+    } catch (std::exception const& e) {
+        error_text_size += render_nested(e).size();
+    }
+}
+} // namespace parse_nested
+
+namespace parse_error_string {
+bool parse(std::string_view doc, std::size_t pos, int level, int& value, std::string& error) {
+    std::size_t end = pos;
+    value = parse_int(doc, end);
+    bool ok = true;
+    if (end == pos) {
+        error = "invalid number";
+        ok = false;
+    } else if (level + 1 < parse_depth) {
+        int rest;
+        ok = parse(doc, end + 1, level + 1, rest, error);
+        value += rest;
+    }
+    if (!ok)
+        error = "level " + std::to_string(level) + " at offset " + std::to_string(pos) + ": " + error;
+    return ok;
+}
+
+void run(std::string_view doc) {
+    int value;
+    std::string error;
+    if (parse(doc, 0, 0, value, error))
+        checksum += value;
+    else
+        error_text_size += error.size();
+}
+} // namespace parse_error_string
+
+/************ inputs and measurements ************/
+
+std::vector<std::string> make_expressions(std::size_t count, double error_rate, std::mt19937& rng) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<std::string> exprs;
+    for (std::size_t i = 0; i < count; ++i) {
+        int a = (int) (rng() % 1000), b = (int) (rng() % 1000) + 1;
+        if (uniform(rng) < error_rate)
+            exprs.push_back(std::to_string(a) + "/0");
+        else
+            exprs.push_back(std::to_string(a) + (rng() % 2 ? "/" : "+") + std::to_string(b));
+    }
+    return exprs;
+}
+
+std::vector<std::string> make_documents(std::size_t count, double error_rate, std::mt19937& rng) {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::vector<std::string> docs;
+    for (std::size_t i = 0; i < count; ++i) {
+        bool error = uniform(rng) < error_rate;
+        int error_level = (int) (rng() % parse_depth);
+        std::string doc;
+        for (int level = 0; level < parse_depth; ++level) {
+            if (level)
+                doc += '/';
+            doc += (error && level == error_level) ? "x" : std::to_string(rng() % 100);
+        }
+        docs.push_back(doc);
+    }
+    return docs;
+}
+
+template<typename Run>
+void measure_strategy(bench::reporter& out, char const* scenario, char const* strategy, double error_rate,
+                      std::vector<std::string> const& inputs, Run run) {
+    std::string name = std::string(scenario) + "/" + strategy;
+    if (!out.enabled(name))
+        return;
+    std::size_t heap_before = heap::current;
+    heap::peak = heap::current;
+
+    // Throughput pass: the clock is only read around the loop, as reading it costs about as much as an operation.
+    double start = bench::now_seconds();
+    for (std::string const& input : inputs)
+        run(input);
+    double elapsed = bench::now_seconds() - start;
+    std::size_t peak_heap = heap::peak - heap_before;
+
+    // Latency pass over the same inputs, for the p99 which includes the clock reads.
+    std::vector<double> latencies(inputs.size());
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        double op_start = bench::now_seconds();
+        run(inputs[i]);
+        latencies[i] = (bench::now_seconds() - op_start) * 1e9;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    out.add(scenario, {{"strategy", strategy}, {"error_rate", bench::to_field(error_rate)}},
+            {{"ops_per_s", bench::to_field(inputs.size() / elapsed)},
+             {"mean_ns", bench::to_field(elapsed * 1e9 / inputs.size())},
+             {"p99_ns", bench::to_field(latencies[latencies.size() * 99 / 100])},
+             {"peak_heap_bytes", bench::to_field((std::uint64_t) peak_heap)}});
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    std::size_t ops = 200000;
+    for (std::string const& arg : opts.extra)
+        if (arg.rfind("--ops=", 0) == 0)
+            ops = std::stoul(arg.substr(6));
+
+    static Message messages[64];
+    diagctx_init(sizeof(Message), messages, 64, nullptr);
+    std::mt19937 rng(42);
+
+    bench::reporter out(opts);
+    for (double error_rate : {0.0, 0.001, 0.01, 0.1, 0.5}) {
+        std::vector<std::string> exprs = make_expressions(ops, error_rate, rng);
+        measure_strategy(out, "eval", "diagctx", error_rate, exprs, eval_diagctx::run);
+        measure_strategy(out, "eval", "nested", error_rate, exprs, eval_nested::run);
+        measure_strategy(out, "eval", "error_string", error_rate, exprs, eval_error_string::run);
+    }
+    for (double error_rate : {0.0, 0.001, 0.01, 0.1, 0.5}) {
+        std::vector<std::string> docs = make_documents(ops, error_rate, rng);
+        measure_strategy(out, "deep_parse", "diagctx", error_rate, docs, parse_diagctx::run);
+        measure_strategy(out, "deep_parse", "nested", error_rate, docs, parse_nested::run);
+        measure_strategy(out, "deep_parse", "error_string", error_rate, docs, parse_error_string::run);
+    }
+    bench::do_not_optimize(checksum);
+    bench::do_not_optimize(error_text_size);
+    return 0;
+}
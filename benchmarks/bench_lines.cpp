@@ -0,0 +1,289 @@
+// Throughput of the line processing of the examples (for_each_line and count_uppercase_ascii)
+// over a generated input of several gigabytes, with a configurable rate of non-ASCII errors.
+// Compares the cost of annotating the per-line hot loop with different kinds of context:
+//   off           no context
+//   static        typed messages holding a pointer to a static string
+//   lazy          typed messages holding the raw arguments (line number, span), formatted only on errors
+//   eager_fixed   diagctx::fixed_message<128> formatted on each push, without allocation
+//   eager_stream  std::ostringstream formatted on each push, as the first version of examples/main.cpp
+// Errors are reported with DIAGCTX_FAIL(), whose report renders the context to memory and throws.
+// Build and run:
+//     g++ -std=c++17 -O2 diagctx.c benchmarks/bench_lines.cpp -o bench_lines && ./bench_lines --csv
+// Options of harness.hpp, and:
+//   --gb=N             gigabytes of input per style (default: 2)
+//   --error-rate=R     fraction of lines with a non-ASCII character (default: 0.0001)
+
+#include "../diagctx.hpp"
+#include "harness.hpp"
+
+#include <cstddef>
+#include <random>
+#include <sstream>
+#include <new>
+#include <string>
+
+namespace {
+
+enum class style { off, static_text, lazy, eager_fixed, eager_stream };
+
+char const* style_names[] = {"off", "static", "lazy", "eager_fixed", "eager_stream"};
+
+struct Span {
+    char const* str;
+    std::size_t length;
+};
+
+struct StreamMessage {
+    std::ostringstream out;
+};
+
+using FixedMessage = diagctx::fixed_message<128>;
+
+unsigned text_type, line_type, span_type;
+std::string rendered; // reused for every error report
+
+void render_text(void*, void* message) {
+    rendered += *static_cast<char const**>(message);
+}
+
+void render_line(void*, void* message) {
+    rendered += "line " + std::to_string(*static_cast<int*>(message));
+}
+
+void render_span(void*, void* message) {
+    Span* span = static_cast<Span*>(message);
+    char out[256];
+    char const* str = span->str;
+    char const* str_end = str + span->length;
+    rendered += "count_uppercase_ascii(\"";
+    while (str != str_end)
+        rendered.append(out, diagctx_escape(out, sizeof(out), &str, str_end));
+    rendered += "\")";
+}
+
+style current_style = style::off;
+
+void render_handler(void*, void* message) {
+    if (message == nullptr)
+        rendered += "???";
+    else if (current_style == style::static_text || current_style == style::lazy)
+        diagctx_render(nullptr, message);
+    else if (current_style == style::eager_fixed)
+        rendered += static_cast<FixedMessage*>(message)->view();
+    else
+        rendered += static_cast<StreamMessage*>(message)->out.str();
+    rendered += '\n';
+}
+
+struct line_error {};
+
+void report_error(void*, int, char const* text, char const*, int) {
+    rendered.clear();
+    rendered += text;
+    rendered += '\n';
+    diagctx_get(-1, render_handler, nullptr);
+    throw line_error();
+}
+
+/************ annotations, selected at compile time ************/
+
+template<style S>
+unsigned push_text(char const* text) {
+    unsigned id = 0;
+    if constexpr (S == style::static_text || S == style::lazy) {
+        char const** msg = static_cast<char const**>(diagctx_push_typed(text_type, &id));
+        if (msg != nullptr)
+            *msg = text;
+    } else if constexpr (S == style::eager_fixed) {
+        id = diagctx::push_message<128>(text);
+    } else if constexpr (S == style::eager_stream) {
+        StreamMessage* msg = static_cast<StreamMessage*>(diagctx_push(&id));
+        if (msg != nullptr)
+            (new (msg) StreamMessage)->out << text;
+    }
+    return id;
+}
+
+template<style S>
+unsigned push_line(int line_number) {
+    if constexpr (S == style::lazy) {
+        unsigned id;
+        int* msg = static_cast<int*>(diagctx_push_typed(line_type, &id));
+        if (msg != nullptr)
+            *msg = line_number;
+        return id;
+    } else if constexpr (S == style::eager_fixed) {
+        return diagctx::push_message<128>("line ", line_number);
+    } else if constexpr (S == style::eager_stream) {
+        unsigned id;
+        StreamMessage* msg = static_cast<StreamMessage*>(diagctx_push(&id));
+        if (msg != nullptr)
+            (new (msg) StreamMessage)->out << "line " << line_number;
+        return id;
+    } else {
+        return push_text<S>("line");
+    }
+}
+
+template<style S>
+unsigned push_span(char const* str, std::size_t length) {
+    if constexpr (S == style::lazy) {
+        unsigned id;
+        Span* msg = static_cast<Span*>(diagctx_push_typed(span_type, &id));
+        if (msg != nullptr)
+            *msg = Span{str, length};
+        return id;
+    } else if constexpr (S == style::eager_fixed) {
+        return diagctx::push_message<128>("count_uppercase_ascii(\"", std::string_view(str, length), "\")");
+    } else if constexpr (S == style::eager_stream) {
+        unsigned id;
+        StreamMessage* msg = static_cast<StreamMessage*>(diagctx_push(&id));
+        if (msg != nullptr)
+            (new (msg) StreamMessage)->out << "count_uppercase_ascii(\"" << std::string_view(str, length) << "\")";
+        return id;
+    } else {
+        return push_text<S>("count_uppercase_ascii");
+    }
+}
+
+template<style S>
+void pop(unsigned id) {
+    if constexpr (S != style::off)
+        diagctx_pop(id);
+}
+
+template<style S>
+void unwind(unsigned id) {
+    if constexpr (S != style::off)
+        diagctx_get(id, nullptr, nullptr);
+}
+
+/************ the workload of the examples ************/
+
+template<style S>
+int count_uppercase_ascii(char const* str, std::size_t length) {
+    unsigned msg_id = push_span<S>(str, length);
+    int count = 0;
+    for (std::size_t i = 0; i < length; ++i) {
+        unsigned char c = str[i];
+        if (c >= 128)
+            DIAGCTX_FAIL("non-ASCII character");
+        count += (c >= 'A' && c <= 'Z');
+    }
+    pop<S>(msg_id);
+    return count;
+}
+
+struct totals {
+    std::uint64_t upper = 0, errors = 0, lines = 0;
+};
+
+template<style S>
+void for_each_line(char const* str, char const* str_end, totals& out) {
+    unsigned msg_id = push_text<S>("for_each_line()");
+    int line_number = 0;
+    while (str != str_end) {
+        char const* line_end = static_cast<char const*>(std::memchr(str, '\n', str_end - str));
+        if (line_end == nullptr)
+            line_end = str_end;
+        ++line_number;
+        try {
+            unsigned msg_id_2 = push_line<S>(line_number);
+            out.upper += count_uppercase_ascii<S>(str, line_end - str);
+            pop<S>(msg_id_2);
+        } catch (line_error const&) {
+            ++out.errors;
+            unwind<S>(msg_id);
+        }
+        ++out.lines;
+        str = line_end + (line_end != str_end);
+    }
+    pop<S>(msg_id);
+}
+
+/************ input and measurements ************/
+
+std::string make_chunk(std::size_t size, double error_rate) {
+    std::mt19937_64 rng(7);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::string chunk;
+    chunk.reserve(size + 128);
+    while (chunk.size() < size) {
+        std::size_t length = 20 + rng() % 80;
+        std::size_t start = chunk.size();
+        for (std::size_t i = 0; i < length; ++i)
+            chunk += (char) (' ' + rng() % 95);
+        if (uniform(rng) < error_rate)
+            chunk[start + rng() % length] = '\x86';
+        chunk += '\n';
+    }
+    return chunk;
+}
+
+template<style S>
+totals stream(std::string const& chunk, std::uint64_t total_bytes) {
+    totals out;
+    for (std::uint64_t done = 0; done < total_bytes; done += chunk.size())
+        for_each_line<S>(chunk.data(), chunk.data() + chunk.size(), out);
+    return out;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    double gigabytes = 2, error_rate = 0.0001;
+    for (std::string const& arg : opts.extra) {
+        if (arg.rfind("--gb=", 0) == 0)
+            gigabytes = std::stod(arg.substr(5));
+        else if (arg.rfind("--error-rate=", 0) == 0)
+            error_rate = std::stod(arg.substr(13));
+    }
+
+    std::string chunk = make_chunk(std::size_t(64) << 20, error_rate);
+    std::uint64_t total_bytes = (std::uint64_t) (gigabytes * 1e9);
+    std::uint64_t rounded_bytes = (total_bytes + chunk.size() - 1) / chunk.size() * chunk.size();
+
+    text_type = diagctx_register_type("text", sizeof(char const*), nullptr, render_text);
+    line_type = diagctx_register_type("line", sizeof(int), nullptr, render_line);
+    span_type = diagctx_register_type("span", sizeof(Span), nullptr, render_span);
+    diagctx_set_report(report_error, nullptr);
+    alignas(std::max_align_t) static char buffer[sizeof(StreamMessage) * 8];
+
+    bench::reporter out(opts);
+    double baseline_seconds = 0;
+    for (style s : {style::off, style::static_text, style::lazy, style::eager_fixed, style::eager_stream}) {
+        char const* name = style_names[(int) s];
+        if (!out.enabled(std::string("lines/") + name) && s != style::off)
+            continue;
+        current_style = s;
+        if (s == style::static_text || s == style::lazy)
+            diagctx_init_typed(buffer, sizeof(buffer));
+        else if (s == style::eager_fixed)
+            diagctx_init(sizeof(FixedMessage), buffer, sizeof(buffer) / sizeof(FixedMessage), nullptr);
+        else if (s == style::eager_stream)
+            diagctx_init(sizeof(StreamMessage), buffer, 8,
+                         [](void* msg) { static_cast<StreamMessage*>(msg)->~StreamMessage(); });
+
+        totals res;
+        double start = bench::now_seconds();
+        switch (s) {
+        case style::off: res = stream<style::off>(chunk, total_bytes); break;
+        case style::static_text: res = stream<style::static_text>(chunk, total_bytes); break;
+        case style::lazy: res = stream<style::lazy>(chunk, total_bytes); break;
+        case style::eager_fixed: res = stream<style::eager_fixed>(chunk, total_bytes); break;
+        case style::eager_stream: res = stream<style::eager_stream>(chunk, total_bytes); break;
+        }
+        double seconds = bench::now_seconds() - start;
+        if (s == style::off)
+            baseline_seconds = seconds;
+
+        out.add("lines", {{"style", name}, {"error_rate", bench::to_field(error_rate)}},
+                {{"gb_per_s", bench::to_field(rounded_bytes / seconds / 1e9)},
+                 {"overhead_percent", bench::to_field((seconds / baseline_seconds - 1) * 100)},
+                 {"ns_per_line", bench::to_field(seconds * 1e9 / res.lines)},
+                 {"errors", bench::to_field(res.errors)},
+                 {"upper", bench::to_field(res.upper)}});
+    }
+    return 0;
+}
@@ -0,0 +1,341 @@
+// Memory footprint of diagctx buffers in a thread-per-connection server, from 1k to 20k threads.
+// Each thread handles a few requests whose nesting depth follows a geometric distribution
+// (mean about 5, capped at 48 messages of 128 bytes), then a fraction of the threads stays in the
+// middle of a request (active) while the others wait for their next request (idle), and the resident
+// memory (RSS) is measured. Buffer strategies:
+//   none      no diagctx buffer, reference for the memory of the threads themselves
+//   fixed     a malloc'ed buffer of 64 messages per thread
+//   reserve   1024 messages per thread reserved in a MAP_NORESERVE mapping, of which the kernel only
+//             commits the pages touched by the deepest request (one mapping carved in slices, as one
+//             mapping per thread would exceed vm.max_map_count next to the thread stacks)
+//   pooled    buffers of 64 messages taken from a shared pool during each request, and given back
+//             after; idle threads have no buffer (capacity 0)
+//   slab      4 messages per thread, carved from a shared slab: a request which goes deeper moves its
+//             messages with diagctx_resize() to a chunk of 64 messages taken from a shared overflow slab,
+//             and moves them back to its slice at the end of the request, giving the chunk back
+// Each measurement runs in a forked process, so that memory freed by the previous one is not counted.
+// diagctx has no pool nor slab: they are implemented here with diagctx_init() and diagctx_resize().
+// Build and run (Linux only):
+//     g++ -std=c++17 -O2 -pthread diagctx.c benchmarks/bench_memory.cpp -o bench_memory && ./bench_memory --csv
+// Options of harness.hpp, and:
+//   --threads=N,N,...   thread counts (default: 1000,5000,20000)
+//   --active=F          fraction of threads in the middle of a request when measuring (default: 0.1)
+//   --stack-kb=N        stack size of the threads (default: 128)
+
+#include "../diagctx.h"
+#include "harness.hpp"
+
+#include <mutex>
+#include <random>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+namespace {
+
+enum class strategy { none, fixed, reserve, pooled, slab };
+
+char const* strategy_names[] = {"none", "fixed", "reserve", "pooled", "slab"};
+
+struct Message {
+    char str[128];
+};
+
+constexpr unsigned fixed_capacity = 64;
+constexpr unsigned reserve_capacity = 1024;
+constexpr unsigned slab_capacity = 4;
+constexpr unsigned max_depth = 48;
+constexpr unsigned warm_requests = 20;
+
+struct config {
+    strategy strat;
+    unsigned nb_threads;
+    double active;
+};
+
+config cfg;
+pthread_barrier_t measured, released;
+char* shared_region = nullptr; // reserve or slab
+char* overflow_region = nullptr; // slab
+char empty_buffer[sizeof(Message)];
+
+/************ pool of buffers ************/
+
+std::mutex pool_mutex;
+std::vector<Message*> pool;
+
+Message* pool_acquire() {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (!pool.empty()) {
+            Message* buffer = pool.back();
+            pool.pop_back();
+            return buffer;
+        }
+    }
+    return new Message[fixed_capacity];
+}
+
+void pool_release(Message* buffer) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool.push_back(buffer);
+}
+
+/************ overflow slab ************/
+
+// Chunks of 'fixed_capacity' messages carved on demand from 'overflow_region', a MAP_NORESERVE mapping
+// with a chunk per thread, so only the chunks used by the deepest concurrent requests are committed.
+// Chunks given back are reused first, as their pages are already committed.
+std::mutex overflow_mutex;
+std::vector<Message*> overflow_free;
+std::size_t overflow_carved = 0;
+
+Message* overflow_acquire() {
+    std::lock_guard<std::mutex> lock(overflow_mutex);
+    if (!overflow_free.empty()) {
+        Message* chunk = overflow_free.back();
+        overflow_free.pop_back();
+        return chunk;
+    }
+    return reinterpret_cast<Message*>(overflow_region) + fixed_capacity * overflow_carved++;
+}
+
+void overflow_release(Message* chunk) {
+    std::lock_guard<std::mutex> lock(overflow_mutex);
+    overflow_free.push_back(chunk);
+}
+
+thread_local Message* slab_slice = nullptr;
+thread_local Message* slab_chunk = nullptr; // chunk of the overflow slab used by the current request
+
+/************ threads ************/
+
+struct thread_result {
+    std::uint64_t pushed, missing;
+};
+
+unsigned draw_depth(std::mt19937& rng) {
+    std::geometric_distribution<unsigned> geometric(0.3);
+    return std::min(max_depth, 3 + geometric(rng));
+}
+
+void nested(unsigned level, unsigned depth, unsigned request, thread_result& res) {
+    unsigned id;
+    if (cfg.strat == strategy::slab && level == slab_capacity && slab_chunk == nullptr) {
+        slab_chunk = overflow_acquire();
+        diagctx_resize(slab_chunk, fixed_capacity, nullptr);
+    }
+    Message* msg = static_cast<Message*>(diagctx_push(&id));
+    ++res.pushed;
+    if (msg != nullptr)
+        std::snprintf(msg->str, sizeof(msg->str), "request %u, level %u: handling /api/v1/items", request, depth);
+    else
+        ++res.missing;
+    if (depth > 1)
+        nested(level + 1, depth - 1, request, res);
+    diagctx_pop(id);
+}
+
+struct thread_args {
+    unsigned index;
+    thread_result res;
+};
+
+void* connection_thread(void* arg_ptr) {
+    thread_args& args = *static_cast<thread_args*>(arg_ptr);
+    std::mt19937 rng(args.index);
+    Message* buffer = nullptr;
+    auto begin_request = [&] {
+        if (cfg.strat == strategy::pooled)
+            diagctx_init(sizeof(Message), buffer = pool_acquire(), fixed_capacity, nullptr);
+    };
+    auto end_request = [&] {
+        if (cfg.strat == strategy::pooled) {
+            pool_release(buffer);
+            diagctx_init(sizeof(Message), empty_buffer, 0, nullptr);
+        }
+        if (cfg.strat == strategy::slab && slab_chunk != nullptr) {
+            overflow_release(static_cast<Message*>(diagctx_resize(slab_slice, slab_capacity, nullptr)));
+            slab_chunk = nullptr;
+        }
+    };
+
+    switch (cfg.strat) {
+    case strategy::none:
+    case strategy::pooled:
+        diagctx_init(sizeof(Message), empty_buffer, 0, nullptr);
+        break;
+    case strategy::fixed:
+        buffer = static_cast<Message*>(std::malloc(fixed_capacity * sizeof(Message)));
+        diagctx_init(sizeof(Message), buffer, fixed_capacity, nullptr);
+        break;
+    case strategy::reserve:
+        diagctx_init(sizeof(Message), shared_region + (std::size_t) args.index * reserve_capacity * sizeof(Message),
+                     reserve_capacity, nullptr);
+        break;
+    case strategy::slab:
+        slab_slice = reinterpret_cast<Message*>(shared_region) + (std::size_t) args.index * slab_capacity;
+        diagctx_init(sizeof(Message), slab_slice, slab_capacity, nullptr);
+        break;
+    }
+
+    for (unsigned request = 0; request < warm_requests; ++request) {
+        begin_request();
+        if (cfg.strat != strategy::none)
+            nested(0, draw_depth(rng), request, args.res);
+        end_request();
+    }
+
+    // Active threads are measured in the middle of a request, idle ones between two requests.
+    bool active = args.index < (unsigned) (cfg.active * cfg.nb_threads);
+    unsigned id = 0;
+    if (active && cfg.strat != strategy::none) {
+        begin_request();
+        Message* msg = static_cast<Message*>(diagctx_push(&id));
+        if (msg != nullptr)
+            std::snprintf(msg->str, sizeof(msg->str), "request in progress");
+    }
+    pthread_barrier_wait(&measured);
+    pthread_barrier_wait(&released);
+    if (active && cfg.strat != strategy::none) {
+        diagctx_pop(id);
+        end_request();
+    }
+    if (cfg.strat == strategy::fixed)
+        std::free(buffer);
+    return nullptr;
+}
+
+double rss_bytes() {
+    long pages = 0, resident = 0;
+    std::FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm == nullptr)
+        return 0;
+    if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    std::fclose(statm);
+    return (double) resident * (double) sysconf(_SC_PAGESIZE);
+}
+
+struct measurement {
+    unsigned created;
+    double rss_before, rss_during;
+    std::uint64_t pushed, missing;
+};
+
+// Runs in the forked child.
+measurement measure_threads(std::size_t stack_size) {
+    measurement m{0, rss_bytes(), 0, 0, 0};
+    if (cfg.strat == strategy::reserve || cfg.strat == strategy::slab) {
+        std::size_t per_thread = (cfg.strat == strategy::reserve ? reserve_capacity : slab_capacity) * sizeof(Message);
+        void* region = mmap(nullptr, per_thread * cfg.nb_threads, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+            return m;
+        shared_region = static_cast<char*>(region);
+    }
+    if (cfg.strat == strategy::slab) {
+        void* region = mmap(nullptr, fixed_capacity * sizeof(Message) * cfg.nb_threads, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+            return m;
+        overflow_region = static_cast<char*>(region);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    std::vector<pthread_t> threads(cfg.nb_threads);
+    std::vector<thread_args> args(cfg.nb_threads);
+    pthread_barrier_init(&measured, nullptr, cfg.nb_threads + 1);
+    pthread_barrier_init(&released, nullptr, cfg.nb_threads + 1);
+    for (unsigned t = 0; t < cfg.nb_threads; ++t) {
+        args[t] = thread_args{t, {0, 0}};
+        if (pthread_create(&threads[t], &attr, connection_thread, &args[t]) != 0)
+            return m; // the barrier cannot be reached: the parent reports how many threads were created
+        m.created = t + 1;
+    }
+    pthread_barrier_wait(&measured);
+    m.rss_during = rss_bytes();
+    pthread_barrier_wait(&released);
+    for (unsigned t = 0; t < cfg.nb_threads; ++t) {
+        pthread_join(threads[t], nullptr);
+        m.pushed += args[t].res.pushed;
+        m.missing += args[t].res.missing;
+    }
+    return m;
+}
+
+bool run_forked(std::size_t stack_size, measurement& m) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        measurement res = measure_threads(stack_size);
+        if (write(fds[1], &res, sizeof(res)) != (ssize_t) sizeof(res))
+            _exit(1);
+        _exit(res.created == cfg.nb_threads ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t size = read(fds[0], &m, sizeof(m));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return size == (ssize_t) sizeof(m);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    std::vector<unsigned> thread_counts = {1000, 5000, 20000};
+    double active = 0.1;
+    std::size_t stack_size = 128 * 1024;
+    for (std::string const& arg : opts.extra) {
+        if (arg.rfind("--threads=", 0) == 0) {
+            thread_counts.clear();
+            for (std::size_t pos = 10; pos < arg.size(); pos = arg.find(',', pos) + 1) {
+                thread_counts.push_back(std::stoul(arg.substr(pos)));
+                if (arg.find(',', pos) == std::string::npos)
+                    break;
+            }
+        } else if (arg.rfind("--active=", 0) == 0) {
+            active = std::stod(arg.substr(9));
+        } else if (arg.rfind("--stack-kb=", 0) == 0) {
+            stack_size = std::stoul(arg.substr(11)) * 1024;
+        }
+    }
+
+    bench::reporter out(opts);
+    for (unsigned nb_threads : thread_counts) {
+        double rss_none = 0;
+        for (strategy s : {strategy::none, strategy::fixed, strategy::reserve, strategy::pooled, strategy::slab}) {
+            if (s != strategy::none && !out.enabled(std::string("memory/") + strategy_names[(int) s]))
+                continue;
+            cfg = config{s, nb_threads, active};
+            measurement m{};
+            if (!run_forked(stack_size, m) || m.created != nb_threads) {
+                std::fprintf(stderr, "%s with %u threads: only %u threads created\n", strategy_names[(int) s],
+                             nb_threads, m.created);
+                continue;
+            }
+            double rss = m.rss_during - m.rss_before;
+            if (s == strategy::none)
+                rss_none = rss;
+            out.add("memory", {{"strategy", strategy_names[(int) s]}, {"threads", bench::to_field(nb_threads)},
+                               {"active", bench::to_field(active)}},
+                    {{"rss_mb", bench::to_field(rss / 1e6)},
+                     {"kb_per_thread", bench::to_field(rss / nb_threads / 1e3)},
+                     {"diagctx_kb_per_thread", bench::to_field((rss - rss_none) / nb_threads / 1e3)},
+                     {"missing_percent", bench::to_field(m.pushed ? 100.0 * m.missing / m.pushed : 0.0)}});
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+// Microbenchmarks of the diagctx operations: push+pop, get, and unwind after longjmp or throw.
+// Build and run:
+//     g++ -std=c++17 -O2 diagctx.c benchmarks/bench_ops.cpp -o bench_ops && ./bench_ops --csv
+// See harness.hpp for the options.
+
+#include "../diagctx.h"
+#include "harness.hpp"
+
+#include <csetjmp>
+#include <stdexcept>
+
+namespace {
+
+constexpr unsigned message_size = 64;
+constexpr unsigned capacity = 1024;
+alignas(16) char buffer[message_size * capacity];
+unsigned destroyed = 0;
+
+// Non-trivial destructor, which cannot be optimized away.
+__attribute__((noinline)) void destroy_message(void* msg) {
+    destroyed += static_cast<unsigned char*>(msg)[0];
+}
+
+void count_handler(void* count, void* message) {
+    *static_cast<unsigned*>(count) += (message != nullptr);
+}
+
+void init(bool with_destructor) {
+    diagctx_init(message_size, buffer, capacity, with_destructor ? destroy_message : nullptr);
+}
+
+void bench_push_pop(bench::reporter& out, bench::options const& opts) {
+    for (bool with_destructor : {false, true}) {
+        init(with_destructor);
+        bench::result res = bench::measure(opts, [](std::uint64_t n) {
+            for (std::uint64_t i = 0; i < n; ++i) {
+                unsigned id;
+                char* msg = static_cast<char*>(diagctx_push(&id));
+                if (msg != nullptr)
+                    msg[0] = 1;
+                bench::clobber_memory();
+                diagctx_pop(id);
+            }
+        });
+        out.add("push_pop", {{"layout", "fixed"}, {"destructor", with_destructor ? "yes" : "no"}},
+                bench::metrics_of(res));
+    }
+
+    // Unconditional writes with a scratch slot, at a depth where half of the pushes overflow.
+    init(false);
+    alignas(16) static char scratch[message_size];
+    diagctx_set_scratch(scratch);
+    std::vector<unsigned> ids(capacity - 1);
+    for (unsigned& id : ids)
+        diagctx_push(&id);
+    bench::result scratch_res = bench::measure(opts, [](std::uint64_t n) {
+        for (std::uint64_t i = 0; i < n; ++i) {
+            unsigned id_1, id_2;
+            static_cast<char*>(diagctx_push(&id_1))[0] = 1;
+            static_cast<char*>(diagctx_push(&id_2))[0] = 2;
+            bench::clobber_memory();
+            diagctx_pop(id_2);
+            diagctx_pop(id_1);
+        }
+    });
+    for (unsigned d = capacity - 1; d-- > 0;)
+        diagctx_pop(ids[d]);
+    scratch_res.ns_per_op /= 2; // per push+pop
+    scratch_res.min_ns_per_op /= 2;
+    out.add("push_pop", {{"layout", "fixed_scratch"}, {"destructor", "no"}}, bench::metrics_of(scratch_res));
+
+    unsigned type_id = diagctx_register_type("bench", message_size, nullptr, nullptr);
+    diagctx_init_typed(buffer, sizeof(buffer));
+    bench::result res = bench::measure(opts, [type_id](std::uint64_t n) {
+        for (std::uint64_t i = 0; i < n; ++i) {
+            unsigned id;
+            char* msg = static_cast<char*>(diagctx_push_typed(type_id, &id));
+            if (msg != nullptr)
+                msg[0] = 1;
+            bench::clobber_memory();
+            diagctx_pop(id);
+        }
+    });
+    out.add("push_pop", {{"layout", "typed"}, {"destructor", "no"}}, bench::metrics_of(res));
+}
+
+void bench_get(bench::reporter& out, bench::options const& opts) {
+    for (unsigned depth = 1; depth <= 1024; depth *= 4) {
+        init(false);
+        std::vector<unsigned> ids(depth);
+        for (unsigned d = 0; d < depth; ++d)
+            static_cast<char*>(diagctx_push(&ids[d]))[0] = 1;
+        unsigned count = 0;
+        bench::result res = bench::measure(opts, [&count](std::uint64_t n) {
+            for (std::uint64_t i = 0; i < n; ++i)
+                diagctx_get(-1, count_handler, &count);
+        });
+        bench::do_not_optimize(count);
+        for (unsigned d = depth; d-- > 0;)
+            diagctx_pop(ids[d]);
+        bench::fields metrics = bench::metrics_of(res);
+        metrics.emplace_back("ns_per_message", bench::to_field(res.ns_per_op / depth));
+        out.add("get", {{"depth", bench::to_field(depth)}}, metrics);
+    }
+}
+
+std::jmp_buf jump_target;
+
+// GCC sees that the recursion never returns, which is intended.
+#pragma GCC diagnostic ignored "-Winfinite-recursion"
+
+__attribute__((noinline)) void nested_longjmp(unsigned depth) {
+    unsigned id;
+    char* msg = static_cast<char*>(diagctx_push(&id));
+    if (msg != nullptr)
+        msg[0] = 1;
+    if (depth <= 1)
+        std::longjmp(jump_target, 1);
+    nested_longjmp(depth - 1);
+    diagctx_pop(id);
+}
+
+__attribute__((noinline)) void nested_throw(unsigned depth) {
+    unsigned id;
+    char* msg = static_cast<char*>(diagctx_push(&id));
+    if (msg != nullptr)
+        msg[0] = 1;
+    if (depth <= 1)
+        throw std::runtime_error("unwind");
+    nested_throw(depth - 1);
+    diagctx_pop(id);
+}
+
+__attribute__((noinline)) void unwind_longjmp(unsigned depth) {
+    if (setjmp(jump_target) == 0)
+        nested_longjmp(depth);
+    diagctx_get(0, nullptr, nullptr);
+}
+
+// Each operation pushes 'depth' messages in nested calls, jumps out of them,
+// and destroys the messages left with diagctx_get(), as an error handler does.
+void bench_unwind(bench::reporter& out, bench::options const& opts) {
+    for (bool with_destructor : {false, true}) {
+        for (unsigned depth = 1; depth <= 1024; depth *= 4) {
+            init(with_destructor);
+            bench::result res = bench::measure(opts, [depth](std::uint64_t n) {
+                for (std::uint64_t i = 0; i < n; ++i)
+                    unwind_longjmp(depth);
+            });
+            out.add("unwind", {{"mechanism", "longjmp"}, {"destructor", with_destructor ? "yes" : "no"},
+                               {"depth", bench::to_field(depth)}}, bench::metrics_of(res));
+
+            res = bench::measure(opts, [depth](std::uint64_t n) {
+                for (std::uint64_t i = 0; i < n; ++i) {
+                    try {
+                        nested_throw(depth);
+                    } catch (std::exception const&) {
+                        diagctx_get(0, nullptr, nullptr);
+                    }
+                }
+            });
+            out.add("unwind", {{"mechanism", "throw"}, {"destructor", with_destructor ? "yes" : "no"},
+                               {"depth", bench::to_field(depth)}}, bench::metrics_of(res));
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    bench::reporter out(opts);
+    if (out.enabled("push_pop"))
+        bench_push_pop(out, opts);
+    if (out.enabled("get"))
+        bench_get(out, opts);
+    if (out.enabled("unwind"))
+        bench_unwind(out, opts);
+    bench::do_not_optimize(destroyed);
+    return 0;
+}
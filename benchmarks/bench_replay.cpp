@@ -0,0 +1,316 @@
+// Replay of the push, pop, get and unwind operations recorded from a live process by recorder.h,
+// to evaluate diagctx configurations on the depths, types and sizes of an actual workload instead of
+// a synthetic one. The stream is decoded before measuring, then replayed in a loop (messages left at
+// the end of the stream are destroyed by diagctx_get(0) before starting again). Each push writes the
+// whole message, of the recorded size. Configurations, all with the same buffer size:
+//   none             the replay loop without diagctx, reference for its own cost
+//   fixed            diagctx_init() with slots of the largest recorded size
+//   typed            diagctx_init_typed() with the recorded types: headers and payloads split
+//   typed_patterns   typed, with a pattern "* > name > *" per type (up to 16), advanced at each push
+// diagctx has no arena nor run-length encoded layout: other layouts are compared by adding cases here.
+// Build and run:
+//     g++ -std=c++17 -O2 diagctx.c benchmarks/bench_replay.cpp -o bench_replay && ./bench_replay ops.trace
+// Options of harness.hpp, and:
+//   --buffer=BYTES   size of the buffer of each configuration (default: 16384)
+// Besides ns per operation, it reports the messages which were not stored, and the ns per operation
+// of the recording (time between operations, including the work of the process, if the clock counts ns).
+
+#include "../diagctx.h"
+#include "harness.hpp"
+#include "recorder.h"
+
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+namespace {
+
+struct op {
+    unsigned char kind; // DIAGCTX_OP_PUSH, POP, UNWIND or GET
+    unsigned arg;       // index in 'stream::types' for PUSH, number of remaining messages for UNWIND
+};
+
+struct recorded_type {
+    std::string name;
+    unsigned size;
+};
+
+struct stream {
+    std::vector<op> ops;
+    std::vector<recorded_type> types;
+    unsigned long long ticks = 0, dropped = 0;
+    unsigned max_depth = 0;
+    double mean_depth = 0; // at each push
+};
+
+class decoder {
+public:
+    explicit decoder(std::string const& data) : m_data(data), m_pos(0) {}
+
+    bool done() const { return m_pos >= m_data.size(); }
+
+    unsigned char byte() {
+        if (done())
+            throw std::runtime_error("truncated stream");
+        return static_cast<unsigned char>(m_data[m_pos++]);
+    }
+
+    unsigned long long varint() {
+        unsigned long long value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b = byte();
+            value |= static_cast<unsigned long long>(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return value;
+        }
+        throw std::runtime_error("invalid varint");
+    }
+
+    std::string bytes(std::size_t size) {
+        if (m_data.size() - m_pos < size)
+            throw std::runtime_error("truncated stream");
+        m_pos += size;
+        return m_data.substr(m_pos - size, size);
+    }
+
+    void skip(std::size_t size) { m_pos += size; }
+
+private:
+    std::string const& m_data;
+    std::size_t m_pos;
+};
+
+// Decode the operations, keeping only the ones which are valid for the depth reconstructed so far:
+// after DROPPED records, the stream may resume in the middle of a request.
+stream read_stream(char const* filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+        throw std::runtime_error(std::string("cannot open '") + filename + "'");
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string const magic = "diagctx-ops 1\n";
+    if (data.compare(0, magic.size(), magic) != 0)
+        throw std::runtime_error(std::string("'") + filename + "' is not a diagctx-ops 1 stream");
+
+    stream s;
+    std::map<unsigned long long, unsigned> type_index; // recorded type id + 1 -> index in 's.types'
+    unsigned depth = 0;
+    double total_depth = 0;
+    decoder in(data);
+    in.skip(magic.size());
+    while (!in.done()) {
+        unsigned char tag = in.byte();
+        switch (tag) {
+        case DIAGCTX_OP_TYPE: {
+            unsigned long long id = in.varint();
+            unsigned size = static_cast<unsigned>(in.varint());
+            std::string name = in.bytes(static_cast<std::size_t>(in.varint()));
+            type_index[id + 1] = static_cast<unsigned>(s.types.size());
+            s.types.push_back({name, size});
+            continue;
+        }
+        case DIAGCTX_OP_SIZE:
+            type_index[0] = static_cast<unsigned>(s.types.size());
+            s.types.push_back({"untyped", static_cast<unsigned>(in.varint())});
+            continue;
+        case DIAGCTX_OP_DROPPED:
+            s.dropped += in.varint();
+            continue;
+        case DIAGCTX_OP_PUSH: {
+            auto it = type_index.find(in.varint());
+            if (it == type_index.end())
+                throw std::runtime_error("push of an undefined type");
+            s.ops.push_back({tag, it->second});
+            total_depth += ++depth;
+            s.max_depth = std::max(s.max_depth, depth);
+            break;
+        }
+        case DIAGCTX_OP_POP:
+            if (depth > 0) {
+                s.ops.push_back({tag, 0});
+                --depth;
+            }
+            break;
+        case DIAGCTX_OP_UNWIND: {
+            unsigned remaining = static_cast<unsigned>(in.varint());
+            if (remaining < depth) {
+                s.ops.push_back({tag, remaining});
+                depth = remaining;
+            }
+            break;
+        }
+        case DIAGCTX_OP_GET:
+            s.ops.push_back({tag, 0});
+            break;
+        default:
+            throw std::runtime_error("invalid record " + std::to_string(tag));
+        }
+        s.ticks += in.varint();
+    }
+    std::size_t pushes = 0;
+    for (op const& o : s.ops)
+        pushes += o.kind == DIAGCTX_OP_PUSH;
+    s.mean_depth = pushes > 0 ? total_depth / pushes : 0;
+    return s;
+}
+
+void count_handler(void* userdata, void* message) {
+    if (message != nullptr)
+        ++*static_cast<unsigned*>(userdata);
+}
+
+enum class config { none, fixed, typed };
+
+// Replays the stream in a loop, resuming where the previous batch stopped.
+template<config Config>
+class replayer {
+public:
+    replayer(stream const& s, std::vector<unsigned> const& type_ids, std::vector<unsigned> const& sizes)
+        : m_stream(s), m_type_ids(type_ids), m_sizes(sizes) {
+        m_ids.reserve(s.max_depth);
+    }
+
+    void run(std::uint64_t n) {
+        op const* ops = m_stream.ops.data();
+        std::size_t size = m_stream.ops.size();
+        for (std::uint64_t i = 0; i < n; ++i) {
+            op const& o = ops[m_pos];
+            switch (o.kind) {
+            case DIAGCTX_OP_PUSH: push(o.arg); break;
+            case DIAGCTX_OP_POP:
+                if constexpr (Config != config::none)
+                    diagctx_pop(m_ids.back());
+                m_ids.pop_back();
+                break;
+            case DIAGCTX_OP_UNWIND: unwind(o.arg); break;
+            case DIAGCTX_OP_GET:
+                if constexpr (Config != config::none)
+                    diagctx_get(-1, count_handler, &m_rendered);
+                else
+                    m_rendered += static_cast<unsigned>(m_ids.size());
+                break;
+            }
+            if (++m_pos == size) {
+                unwind(0);
+                m_pos = 0;
+            }
+        }
+        bench::do_not_optimize(m_rendered);
+    }
+
+    void finish() { unwind(0); }
+
+    std::uint64_t missing = 0, pushes = 0;
+
+private:
+    void push(unsigned type) {
+        unsigned id = static_cast<unsigned>(m_ids.size()) + 1;
+        void* msg = m_local;
+        if constexpr (Config == config::fixed)
+            msg = diagctx_push(&id);
+        else if constexpr (Config == config::typed)
+            msg = diagctx_push_typed(m_type_ids[type], &id);
+        ++pushes;
+        if (msg != nullptr)
+            std::memset(msg, 0x5A, m_sizes[type]);
+        else
+            ++missing;
+        bench::clobber_memory();
+        m_ids.push_back(id);
+    }
+
+    void unwind(unsigned remaining) {
+        if (remaining >= m_ids.size())
+            return;
+        if constexpr (Config != config::none)
+            diagctx_get(remaining, nullptr, nullptr);
+        m_ids.resize(remaining);
+    }
+
+    stream const& m_stream;
+    std::vector<unsigned> const& m_type_ids;
+    std::vector<unsigned> const& m_sizes;
+    std::vector<unsigned> m_ids;
+    std::size_t m_pos = 0;
+    unsigned m_rendered = 0;
+    alignas(std::max_align_t) char m_local[4096] = {};
+};
+
+template<config Config>
+void replay(bench::reporter& out, bench::options const& opts, char const* name, stream const& s,
+            std::vector<unsigned> const& type_ids, std::vector<unsigned> const& sizes) {
+    if (!out.enabled(name))
+        return;
+    replayer<Config> r(s, type_ids, sizes);
+    bench::result res = bench::measure(opts, [&r](std::uint64_t n) { r.run(n); });
+    r.finish();
+    bench::fields metrics = bench::metrics_of(res);
+    metrics.emplace_back("missing_percent",
+                         bench::to_field(r.pushes > 0 ? 100.0 * (double) r.missing / (double) r.pushes : 0.0));
+    metrics.emplace_back("recorded_ns_per_op", bench::to_field((double) s.ticks / (double) s.ops.size()));
+    out.add("replay", {{"config", name}}, metrics);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    unsigned buffer_size = 16384;
+    char const* filename = nullptr;
+    for (std::string const& arg : opts.extra) {
+        if (arg.compare(0, 9, "--buffer=") == 0)
+            buffer_size = static_cast<unsigned>(std::stoul(arg.substr(9)));
+        else
+            filename = arg.c_str();
+    }
+    if (filename == nullptr) {
+        std::fprintf(stderr, "usage: bench_replay [options] ops.trace\n");
+        return 2;
+    }
+    stream s;
+    try {
+        s = read_stream(filename);
+    } catch (std::exception const& e) {
+        std::fprintf(stderr, "bench_replay: %s\n", e.what());
+        return 2;
+    }
+    if (s.ops.empty() || s.types.empty()) {
+        std::fprintf(stderr, "bench_replay: no operation in '%s'\n", filename);
+        return 2;
+    }
+    std::fprintf(stderr, "%zu operations, %zu types, depth %.1f on average and %u at most, %llu events dropped\n",
+                 s.ops.size(), s.types.size(), s.mean_depth, s.max_depth, s.dropped);
+
+    std::vector<unsigned> sizes, type_ids;
+    unsigned largest = 1;
+    for (recorded_type const& t : s.types) {
+        if (t.size > 4096) {
+            std::fprintf(stderr, "bench_replay: type '%s' is larger than 4096 bytes\n", t.name.c_str());
+            return 2;
+        }
+        sizes.push_back(t.size);
+        largest = std::max(largest, t.size);
+    }
+    std::vector<std::max_align_t> buffer(buffer_size / sizeof(std::max_align_t) + 1);
+
+    bench::reporter out(opts);
+    replay<config::none>(out, opts, "none", s, type_ids, sizes);
+
+    diagctx_init(largest, buffer.data(), buffer_size / largest, nullptr);
+    replay<config::fixed>(out, opts, "fixed", s, type_ids, sizes);
+
+    for (recorded_type const& t : s.types)
+        type_ids.push_back(diagctx_register_type(t.name.c_str(), t.size, nullptr, nullptr));
+    diagctx_init_typed(buffer.data(), buffer_size);
+    replay<config::typed>(out, opts, "typed", s, type_ids, sizes);
+
+    // Patterns are registered for the rest of the process, so this configuration comes last.
+    std::vector<std::string> patterns;
+    for (std::size_t i = 0; i < s.types.size() && i < 16; ++i)
+        patterns.push_back("* > " + s.types[i].name + " > *");
+    for (std::string const& pattern : patterns)
+        diagctx_register_pattern(pattern.c_str(), nullptr, nullptr);
+    diagctx_init_typed(buffer.data(), buffer_size);
+    replay<config::typed>(out, opts, "typed_patterns", s, type_ids, sizes);
+    return 0;
+}
@@ -0,0 +1,403 @@
+// Error storms: many threads reporting errors at 100k to 10M errors per second in total, with a
+// bystander thread which never fails and measures the latency of its own operations.
+// Errors are raised with diagctx_warn(), and the report function renders the context with one of:
+//   stderr   diagctx_get() rendering the context, written directly (fwrite, locked by stdio)
+//   async    the rendered report copied into a bounded queue, written by a consumer thread;
+//            reports are dropped when the queue is full
+//   dedup    at most 'dedup_limit' reports per error site (text, file, line) per second, the others are
+//            counted and summarized when the window changes
+//   delta    only the messages which changed since the previous report of the same thread
+//   binary   raw messages and metadata appended to a per-thread buffer, written by blocks
+//   none     no error, as reference for the bystander latency
+// Reports are written to /dev/null unless --sink=PATH is given.
+// diagctx only provides the report hook: these paths are implemented here on top of diagctx_set_report().
+// Build and run:
+//     g++ -std=c++17 -O2 -pthread diagctx.c benchmarks/bench_storm.cpp -o bench_storm && ./bench_storm --csv
+// Options of harness.hpp (--min-time is the duration of each measurement), and:
+//   --threads=N    number of erroring threads (default: std::thread::hardware_concurrency())
+//   --sink=PATH    file receiving the reports (default: /dev/null)
+
+#include "../diagctx.h"
+#include "harness.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+enum class path { none, stderr_direct, async, dedup, delta, binary };
+
+char const* path_names[] = {"none", "stderr", "async", "dedup", "delta", "binary"};
+
+struct Message {
+    char str[48];
+};
+
+constexpr unsigned capacity = 8;
+
+unsigned push(char const* format, unsigned value) {
+    unsigned id;
+    Message* msg = static_cast<Message*>(diagctx_push(&id));
+    if (msg != nullptr)
+        std::snprintf(msg->str, sizeof(msg->str), format, value);
+    return id;
+}
+
+std::FILE* sink = nullptr;
+path current_path = path::none;
+std::atomic<std::uint64_t> nb_written{0}, nb_dropped{0}, nb_suppressed{0}, nb_bytes{0};
+
+void write_out(char const* data, std::size_t size) {
+    std::fwrite(data, 1, size, sink);
+    nb_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+/************ rendering ************/
+
+struct text_writer {
+    char* str;
+    std::size_t size, capacity;
+
+    void append(char const* text) {
+        std::size_t length = std::min(std::strlen(text), capacity - size);
+        std::memcpy(str + size, text, length);
+        size += length;
+    }
+};
+
+void render_handler(void* writer, void* message) {
+    text_writer& out = *static_cast<text_writer*>(writer);
+    out.append("  ");
+    out.append(message != nullptr ? static_cast<Message*>(message)->str : "???");
+    out.append("\n");
+}
+
+std::size_t render(char* str, std::size_t capacity, char const* text) {
+    text_writer out{str, 0, capacity};
+    out.append("WARNING! ");
+    out.append(text);
+    out.append("\n");
+    diagctx_get(-1, render_handler, &out);
+    return out.size;
+}
+
+/************ async: bounded queue and consumer thread ************/
+
+struct record {
+    std::size_t size;
+    char str[248];
+};
+
+class report_queue {
+public:
+    bool push(char const* text) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_size == queue_capacity)
+            return false;
+        record& rec = m_records[(m_head + m_size++) % queue_capacity];
+        rec.size = render(rec.str, sizeof(rec.str), text);
+        return true;
+    }
+
+    // Writes the pending records, returns false if there were none.
+    bool drain() {
+        record batch[64];
+        std::size_t count = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (; count < 64 && m_size > 0; ++count, --m_size, m_head = (m_head + 1) % queue_capacity)
+                batch[count] = m_records[m_head];
+        }
+        for (std::size_t i = 0; i < count; ++i)
+            write_out(batch[i].str, batch[i].size);
+        nb_written.fetch_add(count, std::memory_order_relaxed);
+        return count > 0;
+    }
+
+private:
+    static constexpr std::size_t queue_capacity = 4096;
+    std::mutex m_mutex;
+    record m_records[queue_capacity];
+    std::size_t m_head = 0, m_size = 0;
+};
+
+report_queue queue;
+
+/************ dedup: per-site rate limit, in a fixed table of atomics ************/
+
+constexpr std::uint32_t dedup_limit = 100;
+
+struct dedup_slot {
+    std::atomic<std::uint64_t> key{0};
+    std::atomic<std::uint64_t> window{0};
+    std::atomic<std::uint32_t> count{0};
+};
+
+dedup_slot dedup_table[256];
+
+bool dedup_allow(char const* text, char const* file, int line, std::uint64_t& summary) {
+    std::uint64_t key = (reinterpret_cast<std::uintptr_t>(text) * 31 + reinterpret_cast<std::uintptr_t>(file)) * 31 +
+                        (unsigned) line;
+    key |= 1; // 0 is a free slot
+    dedup_slot& slot = dedup_table[(key * 0x9E3779B97F4A7C15u) >> 56];
+    if (slot.key.exchange(key, std::memory_order_relaxed) != key)
+        slot.count.store(0, std::memory_order_relaxed); // slot taken over by another site
+    std::uint64_t window = (std::uint64_t) bench::now_seconds();
+    std::uint64_t previous = slot.window.load(std::memory_order_relaxed);
+    summary = 0;
+    if (previous != window && slot.window.compare_exchange_strong(previous, window, std::memory_order_relaxed)) {
+        std::uint32_t count = slot.count.exchange(0, std::memory_order_relaxed);
+        summary = count > dedup_limit ? count - dedup_limit : 0;
+    }
+    return slot.count.fetch_add(1, std::memory_order_relaxed) < dedup_limit;
+}
+
+/************ delta: messages which changed since the previous report of the thread ************/
+
+struct delta_state {
+    char previous[capacity][sizeof(Message::str)];
+    unsigned nb_previous = 0;
+    unsigned index = 0, common = 0;
+    bool diverged = false;
+    text_writer out;
+};
+
+void delta_handler(void* state_ptr, void* message) {
+    delta_state& state = *static_cast<delta_state*>(state_ptr);
+    char const* str = message != nullptr ? static_cast<Message*>(message)->str : "???";
+    unsigned i = state.index++;
+    if (i >= capacity)
+        return;
+    if (!state.diverged && i < state.nb_previous && std::strcmp(state.previous[i], str) == 0) {
+        ++state.common;
+        return;
+    }
+    state.diverged = true;
+    std::snprintf(state.previous[i], sizeof(state.previous[i]), "%s", str);
+    state.out.append("  ");
+    state.out.append(str);
+    state.out.append("\n");
+}
+
+/************ binary: raw records in a per-thread buffer ************/
+
+struct binary_header {
+    std::uint64_t timestamp_ns;
+    std::uint64_t text; // address of the static string, resolved offline
+    std::uint32_t line;
+    std::uint32_t nb_messages;
+};
+
+struct binary_buffer {
+    char data[64 * 1024];
+    std::size_t size = 0;
+
+    void flush() {
+        write_out(data, size);
+        size = 0;
+    }
+
+    ~binary_buffer() { flush(); }
+};
+
+void binary_handler(void* buffer_ptr, void* message) {
+    binary_buffer& buffer = *static_cast<binary_buffer*>(buffer_ptr);
+    if (message != nullptr)
+        std::memcpy(buffer.data + buffer.size, message, sizeof(Message));
+    else
+        std::memset(buffer.data + buffer.size, 0, sizeof(Message));
+    buffer.size += sizeof(Message);
+}
+
+/************ report function ************/
+
+void report(void*, int, char const* text, char const* file, int line) {
+    switch (current_path) {
+    case path::none:
+        break;
+    case path::stderr_direct: {
+        char str[256];
+        write_out(str, render(str, sizeof(str), text));
+        nb_written.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    case path::async:
+        if (!queue.push(text))
+            nb_dropped.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case path::dedup: {
+        std::uint64_t summary;
+        bool allowed = dedup_allow(text, file, line, summary);
+        char str[256];
+        if (summary > 0) {
+            int size = std::snprintf(str, sizeof(str), "(%s suppressed %llu times)\n", text, (unsigned long long) summary);
+            write_out(str, (std::size_t) size);
+        }
+        if (allowed) {
+            write_out(str, render(str, sizeof(str), text));
+            nb_written.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            nb_suppressed.fetch_add(1, std::memory_order_relaxed);
+        }
+        break;
+    }
+    case path::delta: {
+        thread_local delta_state state;
+        char str[256];
+        state.out = text_writer{str, 0, sizeof(str)};
+        state.out.append("WARNING! ");
+        state.out.append(text);
+        state.out.append("\n");
+        state.index = state.common = 0;
+        state.diverged = false;
+        diagctx_get(-1, delta_handler, &state);
+        state.nb_previous = std::min(state.index, capacity);
+        char common[32];
+        std::snprintf(common, sizeof(common), "  (%u as before)\n", state.common);
+        state.out.append(common);
+        write_out(str, state.out.size);
+        nb_written.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    case path::binary: {
+        thread_local binary_buffer buffer;
+        if (buffer.size + sizeof(binary_header) + capacity * sizeof(Message) > sizeof(buffer.data))
+            buffer.flush();
+        std::size_t header_pos = buffer.size;
+        buffer.size += sizeof(binary_header);
+        std::size_t first = buffer.size;
+        diagctx_get(-1, binary_handler, &buffer);
+        binary_header header{(std::uint64_t) (bench::now_seconds() * 1e9), reinterpret_cast<std::uintptr_t>(text),
+                             (std::uint32_t) line, (std::uint32_t) ((buffer.size - first) / sizeof(Message))};
+        std::memcpy(buffer.data + header_pos, &header, sizeof(header));
+        nb_written.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    }
+}
+
+/************ threads ************/
+
+char const* const error_texts[] = {"timeout on upstream", "malformed header", "quota exceeded", "checksum mismatch"};
+
+void storm_thread(unsigned index, double errors_per_second, std::atomic<bool> const& stop,
+                  std::atomic<std::uint64_t>& nb_errors) {
+    Message messages[capacity];
+    diagctx_init(sizeof(Message), messages, capacity, nullptr);
+    unsigned conn_id = push("connection %u", index);
+    double interval = errors_per_second > 0 ? 1 / errors_per_second : 1e9;
+    double next = bench::now_seconds();
+    std::uint64_t count = 0;
+    for (unsigned request = 0; !stop.load(std::memory_order_relaxed); ++request) {
+        unsigned req_id = push("request %u", request);
+        unsigned field_id = push("parsing field %u", request % 7);
+        if (bench::now_seconds() >= next) {
+            next += interval;
+            diagctx_warn(error_texts[count++ % 4], __FILE__, __LINE__);
+        }
+        diagctx_pop(field_id);
+        diagctx_pop(req_id);
+    }
+    diagctx_pop(conn_id);
+    nb_errors.fetch_add(count);
+}
+
+// Latencies in nanoseconds of an operation which never fails: 2 nested contexts and a little work.
+std::vector<double> bystander_thread(std::atomic<bool> const& stop) {
+    Message messages[capacity];
+    diagctx_init(sizeof(Message), messages, capacity, nullptr);
+    std::vector<double> latencies;
+    latencies.reserve(1 << 20);
+    unsigned checksum = 0;
+    for (unsigned i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+        double start = bench::now_seconds();
+        unsigned id_1 = push("task %u", i);
+        unsigned id_2 = push("step %u", i % 3);
+        for (unsigned j = 0; j < 64; ++j)
+            checksum += (checksum >> 3) ^ j;
+        diagctx_pop(id_2);
+        diagctx_pop(id_1);
+        latencies.push_back((bench::now_seconds() - start) * 1e9);
+    }
+    bench::do_not_optimize(checksum);
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+void run_storm(bench::reporter& out, path p, double total_rate, unsigned nb_threads, double seconds) {
+    current_path = p;
+    nb_written = nb_dropped = nb_suppressed = nb_bytes = 0;
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> nb_errors{0};
+    std::vector<std::thread> threads;
+    std::vector<double> latencies;
+
+    double start = bench::now_seconds();
+    if (p != path::none)
+        for (unsigned t = 0; t < nb_threads; ++t)
+            threads.emplace_back(storm_thread, t, total_rate / nb_threads, std::cref(stop), std::ref(nb_errors));
+    std::thread consumer;
+    if (p == path::async)
+        consumer = std::thread([&stop] {
+            while (!stop.load(std::memory_order_relaxed))
+                if (!queue.drain())
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+        });
+    std::thread bystander([&] { latencies = bystander_thread(stop); });
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop.store(true);
+    for (std::thread& thread : threads)
+        thread.join();
+    bystander.join();
+    if (consumer.joinable())
+        consumer.join();
+    double elapsed = bench::now_seconds() - start;
+    while (queue.drain()) {
+    }
+    std::fflush(sink);
+
+    auto percentile = [&latencies](double q) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (std::size_t) (latencies.size() * q))];
+    };
+    out.add("storm", {{"path", path_names[(int) p]}, {"target_errors_per_s", bench::to_field(total_rate)},
+                      {"threads", bench::to_field(nb_threads)}},
+            {{"errors_per_s", bench::to_field(nb_errors / elapsed)},
+             {"written_per_s", bench::to_field(nb_written / elapsed)},
+             {"dropped", bench::to_field((std::uint64_t) nb_dropped)},
+             {"suppressed", bench::to_field((std::uint64_t) nb_suppressed)},
+             {"mb_written", bench::to_field(nb_bytes / 1e6)},
+             {"bystander_p50_ns", bench::to_field(percentile(0.5))},
+             {"bystander_p99_ns", bench::to_field(percentile(0.99))},
+             {"bystander_max_ns", bench::to_field(latencies.empty() ? 0.0 : latencies.back())}});
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    unsigned nb_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string sink_path = "/dev/null";
+    for (std::string const& arg : opts.extra) {
+        if (arg.rfind("--threads=", 0) == 0)
+            nb_threads = std::stoul(arg.substr(10));
+        else if (arg.rfind("--sink=", 0) == 0)
+            sink_path = arg.substr(7);
+    }
+    sink = std::fopen(sink_path.c_str(), "wb");
+    if (sink == nullptr) {
+        std::perror(sink_path.c_str());
+        return 1;
+    }
+    diagctx_set_report(report, nullptr);
+
+    bench::reporter out(opts);
+    if (out.enabled("storm/none"))
+        run_storm(out, path::none, 0, nb_threads, opts.min_time);
+    for (double rate : {1e5, 1e6, 1e7})
+        for (path p : {path::stderr_direct, path::async, path::dedup, path::delta, path::binary})
+            if (out.enabled(std::string("storm/") + path_names[(int) p]))
+                run_storm(out, p, rate, nb_threads, opts.min_time);
+    std::fclose(sink);
+    return 0;
+}
@@ -0,0 +1,249 @@
+// Scaling of diagctx with the number of threads, from 1 to the number of cores.
+// Each thread runs loops of push, push, get, pop, pop on its own context, and the throughput
+// per thread is reported for each thread count: it must stay flat for diagctx to scale linearly.
+//   tls       the default thread-local context of each thread
+//   adjacent  contexts and buffers of all threads packed in shared arrays (diagctx_swap), so that
+//             neighbouring threads write to the same cache lines (false sharing)
+//   padded    same, with each context and buffer on its own cache lines
+//   churn     threads created and joined continuously, each running a few operations, with:
+//             malloc'ed context buffers, buffers recycled through a pool, and in both cases with or
+//             without registering the context in a thread registry (as a crash handler enumerating
+//             the contexts of all threads would need)
+// diagctx itself has no registry nor pool: the ones measured here are the simplest implementations
+// on top of diagctx_swap(), a mutex-protected list and free list.
+// Build and run:
+//     g++ -std=c++17 -O2 -pthread diagctx.c benchmarks/bench_threads.cpp -o bench_threads && ./bench_threads --csv
+// Options of harness.hpp (--min-time is the duration of each measurement), and:
+//   --threads=N    maximal number of threads (default: std::thread::hardware_concurrency())
+
+#include "../diagctx.h"
+#include "harness.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+constexpr unsigned message_size = 16;
+constexpr unsigned capacity = 4;
+constexpr std::size_t cache_line = 64;
+
+void count_handler(void* count, void* message) {
+    *static_cast<unsigned*>(count) += (message != nullptr);
+}
+
+// One operation: the typical pattern of two nested functions adding context, with a lookup.
+inline void operation(std::uint64_t i) {
+    unsigned id_1, id_2, count = 0;
+    char* msg = static_cast<char*>(diagctx_push(&id_1));
+    if (msg != nullptr)
+        msg[0] = (char) i;
+    msg = static_cast<char*>(diagctx_push(&id_2));
+    if (msg != nullptr)
+        msg[0] = (char) (i >> 8);
+    diagctx_get(-1, count_handler, &count);
+    bench::do_not_optimize(count);
+    diagctx_pop(id_2);
+    diagctx_pop(id_1);
+}
+
+// Runs 'body(thread_index, stop)' on 'nb_threads' threads started together, for 'seconds',
+// and returns the number of operations per second per thread.
+template<typename Body>
+double run_threads(unsigned nb_threads, double seconds, Body body) {
+    std::atomic<unsigned> ready{0};
+    std::atomic<bool> start{false}, stop{false};
+    std::vector<std::uint64_t> ops(nb_threads * (cache_line / sizeof(std::uint64_t)));
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nb_threads; ++t) {
+        threads.emplace_back([&, t] {
+            ready.fetch_add(1);
+            while (!start.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            ops[t * (cache_line / sizeof(std::uint64_t))] = body(t, stop);
+        });
+    }
+    while (ready.load() != nb_threads)
+        std::this_thread::yield();
+    double begin = bench::now_seconds();
+    start.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread& thread : threads)
+        thread.join();
+    double elapsed = bench::now_seconds() - begin;
+    std::uint64_t total = 0;
+    for (unsigned t = 0; t < nb_threads; ++t)
+        total += ops[t * (cache_line / sizeof(std::uint64_t))];
+    return total / elapsed / nb_threads;
+}
+
+std::uint64_t loop_until_stop(std::atomic<bool> const& stop) {
+    std::uint64_t n = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 256; ++i)
+            operation(n + i);
+        n += 256;
+    }
+    return n;
+}
+
+/************ thread-local context, and swapped contexts packed or padded ************/
+
+double bench_tls(unsigned nb_threads, double seconds) {
+    return run_threads(nb_threads, seconds, [](unsigned, std::atomic<bool> const& stop) {
+        alignas(cache_line) char buffer[message_size * capacity];
+        diagctx_init(message_size, buffer, capacity, nullptr);
+        return loop_until_stop(stop);
+    });
+}
+
+double bench_layout(unsigned nb_threads, double seconds, bool padded) {
+    auto round = [padded](std::size_t size) {
+        return padded ? (size + cache_line - 1) / cache_line * cache_line : size;
+    };
+    std::size_t context_stride = round(diagctx_context_size());
+    std::size_t buffer_stride = round(message_size * capacity);
+    std::vector<char> storage((context_stride + buffer_stride) * nb_threads + 2 * cache_line);
+    char* base = storage.data() + (cache_line - reinterpret_cast<std::uintptr_t>(storage.data()) % cache_line);
+    char* contexts = base;
+    char* buffers = base + round(context_stride * nb_threads);
+
+    return run_threads(nb_threads, seconds, [&](unsigned t, std::atomic<bool> const& stop) {
+        diagctx_swap(reinterpret_cast<diagctx_context*>(contexts + t * context_stride));
+        diagctx_init(message_size, buffers + t * buffer_stride, capacity, nullptr);
+        std::uint64_t n = loop_until_stop(stop);
+        diagctx_swap(nullptr);
+        return n;
+    });
+}
+
+/************ thread churn, with a buffer pool and a thread registry ************/
+
+struct thread_state {
+    thread_state* next; // in the pool or in the registry
+    thread_state* previous;
+    alignas(cache_line) char buffer[message_size * capacity];
+};
+
+class buffer_pool {
+public:
+    ~buffer_pool() {
+        while (m_free != nullptr)
+            delete std::exchange(m_free, m_free->next);
+    }
+
+    thread_state* acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_free != nullptr)
+                return std::exchange(m_free, m_free->next);
+        }
+        return new thread_state;
+    }
+
+    void release(thread_state* state) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        state->next = m_free;
+        m_free = state;
+    }
+
+private:
+    std::mutex m_mutex;
+    thread_state* m_free = nullptr;
+};
+
+class thread_registry {
+public:
+    void add(thread_state* state) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        state->previous = nullptr;
+        state->next = m_head;
+        if (m_head != nullptr)
+            m_head->previous = state;
+        m_head = state;
+    }
+
+    void remove(thread_state* state) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        (state->previous != nullptr ? state->previous->next : m_head) = state->next;
+        if (state->next != nullptr)
+            state->next->previous = state->previous;
+    }
+
+private:
+    std::mutex m_mutex;
+    thread_state* m_head = nullptr;
+};
+
+constexpr unsigned ops_per_short_thread = 1000;
+
+// Each of the 'nb_threads' workers spawns short-lived threads one after the other.
+double bench_churn(unsigned nb_threads, double seconds, bool pooled, bool registered) {
+    buffer_pool pool;
+    thread_registry registry;
+    return run_threads(nb_threads, seconds, [&](unsigned, std::atomic<bool> const& stop) {
+        std::uint64_t n = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            std::thread([&] {
+                thread_state* state = pooled ? pool.acquire() : new thread_state;
+                if (registered)
+                    registry.add(state);
+                diagctx_init(message_size, state->buffer, capacity, nullptr);
+                for (unsigned i = 0; i < ops_per_short_thread; ++i)
+                    operation(i);
+                if (registered)
+                    registry.remove(state);
+                if (pooled)
+                    pool.release(state);
+                else
+                    delete state;
+            }).join();
+            n += ops_per_short_thread;
+        }
+        return n;
+    });
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench::options opts = bench::parse_options(argc, argv);
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (std::string const& arg : opts.extra)
+        if (arg.rfind("--threads=", 0) == 0)
+            max_threads = std::stoul(arg.substr(10));
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned n = 1; n < max_threads; n *= 2)
+        thread_counts.push_back(n);
+    thread_counts.push_back(max_threads);
+
+    bench::reporter out(opts);
+    double seconds = opts.min_time;
+    auto add = [&](char const* name, bench::fields params, unsigned nb_threads, double ops_per_thread) {
+        params.emplace_back("threads", bench::to_field(nb_threads));
+        out.add(name, params, {{"ops_per_s_per_thread", bench::to_field(ops_per_thread)},
+                               {"ns_per_op", bench::to_field(1e9 / ops_per_thread)},
+                               {"ops_per_s", bench::to_field(ops_per_thread * nb_threads)}});
+    };
+    for (unsigned nb_threads : thread_counts) {
+        if (out.enabled("threads/tls"))
+            add("threads", {{"layout", "tls"}}, nb_threads, bench_tls(nb_threads, seconds));
+        if (out.enabled("threads/adjacent"))
+            add("threads", {{"layout", "adjacent"}}, nb_threads, bench_layout(nb_threads, seconds, false));
+        if (out.enabled("threads/padded"))
+            add("threads", {{"layout", "padded"}}, nb_threads, bench_layout(nb_threads, seconds, true));
+    }
+    for (unsigned nb_threads : thread_counts) {
+        for (bool pooled : {false, true}) {
+            for (bool registered : {false, true}) {
+                if (out.enabled("churn"))
+                    add("churn", {{"buffers", pooled ? "pool" : "malloc"}, {"registry", registered ? "yes" : "no"}},
+                        nb_threads, bench_churn(nb_threads, seconds, pooled, registered));
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Compare the code size of the examples, with and without diagctx instrumentation.
+# Usage: benchmarks/code_size.sh [extra compiler flags...]   (default: -O2)
+# Requires a GCC-compatible compiler and binutils (nm, size).
+set -e
+cd "$(dirname "$0")/.."
+OUT=${TMPDIR:-/tmp}/diagctx-code-size
+mkdir -p "$OUT"
+FLAGS=${*:--O2}
+CC=${CC:-gcc}
+CXX=${CXX:-g++}
+
+# diagctx.c is always built normally: it also provides DIAGCTX_FAIL() to the uninstrumented builds.
+$CC -std=c89 $FLAGS -c diagctx.c -o "$OUT/diagctx_c.o"
+$CXX -x c++ -std=c++17 $FLAGS -c diagctx.c -o "$OUT/diagctx_cpp.o"
+
+build() { # name compiler std source
+    $2 -std=$3 $FLAGS -c "$4" -o "$OUT/$1.o"
+    $2 -std=$3 $FLAGS -include benchmarks/no_context.h -c "$4" -o "$OUT/$1_noctx.o"
+}
+build main_c "$CC" gnu89 examples/main.c
+build main_cpp "$CXX" c++17 examples/main.cpp
+
+symbol_size() { # object symbol ; hot part only, "[clone .cold]" parts are outlined by the compiler
+    nm -S -C "$1" | awk -v sym="$2" '
+        { name = $0; sub(/^[^ ]+ [^ ]+ [^ ]+ /, "", name) }
+        (name == sym || index(name, sym "(") == 1) && name !~ /\[clone/ { total += ("0x" $2) + 0; found = 1 }
+        END { if (found) printf "%d", total; else printf "-" }'
+}
+text_size() { # object
+    size -A "$1" | awk '$1 ~ /^\.text/ { total += $2 } END { print total + 0 }'
+}
+
+printf '%-10s %-24s %14s %12s\n' example function instrumented uninstrumented
+for ex in main_c main_cpp; do
+    for fn in count_uppercase_ascii for_each_line main; do
+        printf '%-10s %-24s %14s %12s\n' "$ex" "$fn" \
+            "$(symbol_size "$OUT/$ex.o" "$fn")" "$(symbol_size "$OUT/${ex}_noctx.o" "$fn")"
+    done
+    printf '%-10s %-24s %14s %12s\n' "$ex" "(.text total)" \
+        "$(text_size "$OUT/$ex.o")" "$(text_size "$OUT/${ex}_noctx.o")"
+done
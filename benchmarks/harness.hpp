@@ -0,0 +1,311 @@
+// Minimal benchmark harness shared by the diagctx benchmarks (C++17, no dependency).
+// Each benchmark binary accepts:
+//   --csv | --json        output format (default: a table for humans)
+//   --min-time=SECONDS    minimal duration of each measurement (default: 0.1)
+//   --filter=TEXT         only run the benchmarks whose name contains TEXT
+//   --counters            also report hardware counters per operation (Linux perf_event_open):
+//                         cycles, instructions, L1D and LLC misses, branch misses.
+//                         Counters which cannot be opened are left out, with a note on stderr.
+// Results are printed on stdout, one row per measurement, with the parameters as extra columns.
+
+#ifndef DIAGCTX_BENCH_HARNESS
+#define DIAGCTX_BENCH_HARNESS
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+// Prevent the compiler from optimizing away 'value' or the computations leading to it.
+template<typename T>
+inline void do_not_optimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobber_memory() {
+    asm volatile("" : : : "memory");
+}
+
+inline double now_seconds() {
+    using clock = std::chrono::steady_clock;
+    return std::chrono::duration<double>(clock::now().time_since_epoch()).count();
+}
+
+enum class format { table, csv, json };
+
+struct options {
+    format output = format::table;
+    double min_time = 0.1;
+    std::string filter;
+    bool counters = false;
+    std::vector<std::string> extra; // arguments not handled by the harness
+};
+
+inline options parse_options(int argc, char** argv) {
+    options opts;
+    for (int i = 1; i < argc; ++i) {
+        char const* arg = argv[i];
+        if (std::strcmp(arg, "--csv") == 0)
+            opts.output = format::csv;
+        else if (std::strcmp(arg, "--json") == 0)
+            opts.output = format::json;
+        else if (std::strncmp(arg, "--min-time=", 11) == 0)
+            opts.min_time = std::atof(arg + 11);
+        else if (std::strncmp(arg, "--filter=", 9) == 0)
+            opts.filter = arg + 9;
+        else if (std::strcmp(arg, "--counters") == 0)
+            opts.counters = true;
+        else
+            opts.extra.push_back(arg);
+    }
+    return opts;
+}
+
+// Parameters and metrics of a row, as (name, value) pairs.
+using fields = std::vector<std::pair<std::string, std::string>>;
+
+inline std::string to_field(double value) {
+    char str[64];
+    std::snprintf(str, sizeof(str), "%.6g", value);
+    return str;
+}
+
+inline std::string to_field(std::uint64_t value) { return std::to_string(value); }
+inline std::string to_field(unsigned value) { return std::to_string(value); }
+inline std::string to_field(int value) { return std::to_string(value); }
+inline std::string to_field(std::string value) { return value; }
+inline std::string to_field(char const* value) { return value; }
+
+// Prints the rows in the requested format. CSV headers are printed again when the columns change.
+class reporter {
+public:
+    explicit reporter(options const& opts) : m_opts(opts) {
+        if (m_opts.output == format::json)
+            std::printf("[\n");
+    }
+
+    ~reporter() {
+        if (m_opts.output == format::json)
+            std::printf("\n]\n");
+    }
+
+    bool enabled(std::string const& name) const {
+        return m_opts.filter.empty() || name.find(m_opts.filter) != std::string::npos;
+    }
+
+    void add(std::string const& name, fields const& params, fields const& metrics) {
+        fields row;
+        row.emplace_back("benchmark", name);
+        row.insert(row.end(), params.begin(), params.end());
+        row.insert(row.end(), metrics.begin(), metrics.end());
+        switch (m_opts.output) {
+        case format::json: print_json(row); break;
+        case format::csv: print_separated(row, ","); break;
+        case format::table: print_separated(row, "  "); break;
+        }
+        std::fflush(stdout);
+    }
+
+private:
+    void print_separated(fields const& row, char const* separator) {
+        std::vector<std::string> columns;
+        for (auto const& field : row)
+            columns.push_back(field.first);
+        if (columns != m_columns) {
+            m_columns = columns;
+            for (std::size_t i = 0; i < row.size(); ++i)
+                std::printf("%s%-*s", i ? separator : "", width(i, row), row[i].first.c_str());
+            std::printf("\n");
+        }
+        for (std::size_t i = 0; i < row.size(); ++i)
+            std::printf("%s%-*s", i ? separator : "", width(i, row), row[i].second.c_str());
+        std::printf("\n");
+    }
+
+    int width(std::size_t i, fields const& row) const {
+        if (m_opts.output != format::table)
+            return 0;
+        return (int) std::max<std::size_t>({row[i].first.size(), row[i].second.size(), i == 0 ? 24u : 10u});
+    }
+
+    void print_json(fields const& row) {
+        std::printf("%s  {", m_first ? "" : ",\n");
+        m_first = false;
+        for (std::size_t i = 0; i < row.size(); ++i) {
+            std::string const& value = row[i].second;
+            char* end = nullptr;
+            std::strtod(value.c_str(), &end);
+            bool is_number = !value.empty() && end == value.c_str() + value.size();
+            std::printf("%s\"%s\": %s%s%s", i ? ", " : "", row[i].first.c_str(),
+                        is_number ? "" : "\"", value.c_str(), is_number ? "" : "\"");
+        }
+        std::printf("}");
+    }
+
+    options m_opts;
+    std::vector<std::string> m_columns;
+    bool m_first = true;
+};
+
+// Hardware counters of the calling thread, in user space only, so that perf_event_paranoid <= 2 is enough.
+// Each counter is opened on its own: the ones not supported (other OS, VM without PMU) are skipped.
+// When the PMU multiplexes them, the values are scaled by the fraction of time they were running.
+class counters {
+public:
+    counters() {
+#ifdef __linux__
+        add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        add("l1d_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+        add("llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        add("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    }
+
+    ~counters() {
+#ifdef __linux__
+        for (counter const& c : m_counters)
+            close(c.fd);
+#endif
+    }
+
+    counters(counters const&) = delete;
+    counters& operator=(counters const&) = delete;
+
+    bool available() const { return !m_counters.empty(); }
+    std::string const& missing() const { return m_missing; }
+
+    void start() {
+#ifdef __linux__
+        for (counter const& c : m_counters) {
+            ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Values since start(), as (name, count) pairs.
+    std::vector<std::pair<std::string, double>> stop() {
+        std::vector<std::pair<std::string, double>> values;
+#ifdef __linux__
+        for (counter const& c : m_counters)
+            ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+        for (counter const& c : m_counters) {
+            std::uint64_t data[3]; // value, time enabled, time running
+            if (read(c.fd, data, sizeof(data)) != (ssize_t) sizeof(data) || data[2] == 0)
+                continue;
+            values.emplace_back(c.name, (double) data[0] * ((double) data[1] / (double) data[2]));
+        }
+#endif
+        return values;
+    }
+
+private:
+#ifdef __linux__
+    struct counter {
+        char const* name;
+        int fd;
+    };
+
+    void add(char const* name, std::uint32_t type, std::uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0)
+            m_counters.push_back(counter{name, fd});
+        else
+            m_missing += std::string(m_missing.empty() ? "" : ", ") + name;
+    }
+
+    std::vector<counter> m_counters;
+    std::string m_missing;
+#else
+    std::string m_missing = "all (perf_event_open is Linux only)";
+#endif
+};
+
+// Counters of the main thread, opened on first use.
+inline counters& thread_counters() {
+    static counters instance;
+    static bool noted = false;
+    if (!noted && !instance.missing().empty())
+        std::fprintf(stderr, "note: hardware counters not available: %s\n", instance.missing().c_str());
+    noted = true;
+    return instance;
+}
+
+struct result {
+    double ns_per_op;      // median of the repetitions
+    double min_ns_per_op;  // best repetition
+    std::uint64_t iterations; // per repetition
+    std::vector<std::pair<std::string, double>> counters_per_op; // with --counters only
+};
+
+// Run 'batch(n)', which must perform 'n' operations, until the time of a repetition
+// reaches 'min_time', then take the median of 5 repetitions.
+template<typename Batch>
+result measure(options const& opts, Batch&& batch) {
+    std::uint64_t n = 1;
+    for (;;) {
+        double start = now_seconds();
+        batch(n);
+        double elapsed = now_seconds() - start;
+        if (elapsed >= opts.min_time / 5 || n >= (std::uint64_t(1) << 40))
+            break;
+        double factor = elapsed > 0 ? (opts.min_time / 5) / elapsed * 1.2 : 100;
+        n = std::max<std::uint64_t>(n + 1, (std::uint64_t) (n * std::min(factor, 100.0)));
+    }
+    std::vector<double> samples;
+    for (int rep = 0; rep < 5; ++rep) {
+        double start = now_seconds();
+        batch(n);
+        samples.push_back((now_seconds() - start) * 1e9 / (double) n);
+    }
+    std::sort(samples.begin(), samples.end());
+    result res{samples[samples.size() / 2], samples.front(), n, {}};
+
+    // An additional repetition, so that reading the counters does not disturb the timings.
+    if (opts.counters && thread_counters().available()) {
+        thread_counters().start();
+        batch(n);
+        res.counters_per_op = thread_counters().stop();
+        for (auto& value : res.counters_per_op)
+            value.second /= (double) n;
+    }
+    return res;
+}
+
+inline fields metrics_of(result const& res) {
+    fields metrics = {{"ns_per_op", to_field(res.ns_per_op)},
+                      {"min_ns_per_op", to_field(res.min_ns_per_op)},
+                      {"iterations", to_field(res.iterations)}};
+    for (auto const& value : res.counters_per_op)
+        metrics.emplace_back(value.first + "_per_op", to_field(value.second));
+    return metrics;
+}
+
+} // namespace bench
+
+#endif
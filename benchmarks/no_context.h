@@ -0,0 +1,9 @@
+/* Forced-included by code_size.sh (-include) to build the examples without context.
+ * The messages are compiled out, but the error reporting of DIAGCTX_FAIL() is kept,
+ * so that the comparison only measures the cost of the context instrumentation. */
+#include "../diagctx.h"
+
+#define diagctx_init(message_size, buffer, capacity, msg_destructor) ((void)(buffer))
+#define diagctx_push(msg_id) (*(msg_id) = 0, (void*)0)
+#define diagctx_pop(msg_id) ((void)(msg_id))
+#define diagctx_get(msg_id, handler, userdata) ((void)(msg_id), (void)(handler), (void)(userdata))
@@ -0,0 +1,150 @@
+/* Recorder of the push, pop, get and unwind operations of a live process, replayed by bench_replay.cpp.
+ * It is a sink for diagctx_trace_init() with a threshold of 0, which keeps every request, so diagctx.c
+ * must be compiled with DIAGCTX_TRACE, and a clock set with diagctx_set_profile_clock() for the timings.
+ * A recorder writes the operations of one context, so each thread has its own recorder and file:
+ *     static diagctx_recorder recorder;
+ *     static diagctx_trace_event ring[4096]; // more than the events of a request, or some are dropped
+ *     diagctx_recorder_open(&recorder, fopen("ops.trace", "wb"), 0); // message_size for diagctx_init()
+ *     diagctx_trace_init(ring, 4096, 0, diagctx_recorder_sink, &recorder);
+ *     ... requests ...
+ *     diagctx_recorder_close(&recorder); // closes the file
+ *
+ * The stream starts with "diagctx-ops 1\n", followed by records made of a tag byte and unsigned LEB128 varints:
+ *     0 PUSH     type (0 if untyped, type_id + 1), ticks since the previous operation
+ *     1 POP      ticks
+ *     2 UNWIND   number of remaining messages, ticks
+ *     3 GET      ticks
+ *     4 TYPE     type_id, size, length of the name, name; before the first PUSH of the type
+ *     5 SIZE     message_size of an untyped context
+ *     6 DROPPED  number of events lost before the next records, because the ring was full
+ * Reports are not recorded, as they are not operations of diagctx. */
+
+#ifndef DIAGCTX_RECORDER_H
+#define DIAGCTX_RECORDER_H
+
+#include "../diagctx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DIAGCTX_OP_PUSH 0
+#define DIAGCTX_OP_POP 1
+#define DIAGCTX_OP_UNWIND 2
+#define DIAGCTX_OP_GET 3
+#define DIAGCTX_OP_TYPE 4
+#define DIAGCTX_OP_SIZE 5
+#define DIAGCTX_OP_DROPPED 6
+
+/* The functions are defined here, and unused ones (by bench_replay.cpp) must not warn. */
+#if defined(__GNUC__)
+#    define DIAGCTX_RECORDER_FN static __attribute__((unused))
+#else
+#    define DIAGCTX_RECORDER_FN static
+#endif
+
+typedef struct {
+    FILE* file;
+    unsigned long long last_time; /* time of the previous operation, 0 before the first one */
+    unsigned char* defined;       /* bits of the types whose TYPE record is written, grown with the type ids */
+    unsigned defined_size;        /* bytes of 'defined' */
+} diagctx_recorder;
+
+DIAGCTX_RECORDER_FN void diagctx_recorder_varint(FILE* file, unsigned long long value) {
+    while (value >= 0x80) {
+        putc((int) (value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    putc((int) value, file);
+}
+
+DIAGCTX_RECORDER_FN void diagctx_recorder_open(diagctx_recorder* recorder, FILE* file, unsigned message_size) {
+    recorder->file = file;
+    recorder->last_time = 0;
+    recorder->defined = NULL;
+    recorder->defined_size = 0;
+    fputs("diagctx-ops 1\n", file);
+    if (message_size != 0) {
+        putc(DIAGCTX_OP_SIZE, file);
+        diagctx_recorder_varint(file, message_size);
+    }
+}
+
+DIAGCTX_RECORDER_FN void diagctx_recorder_close(diagctx_recorder* recorder) {
+    free(recorder->defined);
+    recorder->defined = NULL;
+    recorder->defined_size = 0;
+    fclose(recorder->file);
+}
+
+/* Return whether the TYPE record of 'type_id' must be written, and mark it as written.
+ * If the bits cannot be grown, the record is written again, which the replay accepts. */
+DIAGCTX_RECORDER_FN int diagctx_recorder_define(diagctx_recorder* recorder, unsigned type_id) {
+    unsigned byte = type_id / 8;
+    if (byte >= recorder->defined_size) {
+        unsigned size = recorder->defined_size != 0 ? recorder->defined_size : 8;
+        unsigned char* defined;
+        while (size <= byte)
+            size *= 2;
+        defined = (unsigned char*) realloc(recorder->defined, size);
+        if (defined == NULL)
+            return 1;
+        while (recorder->defined_size < size)
+            defined[recorder->defined_size++] = 0;
+        recorder->defined = defined;
+    }
+    if (recorder->defined[byte] & (1u << (type_id % 8)))
+        return 0;
+    recorder->defined[byte] |= (unsigned char) (1u << (type_id % 8));
+    return 1;
+}
+
+DIAGCTX_RECORDER_FN void diagctx_recorder_sink(void* userdata, diagctx_trace_event const* events, unsigned count,
+                                               unsigned long long dropped)
+{
+    diagctx_recorder* recorder = (diagctx_recorder*) userdata;
+    FILE* file = recorder->file;
+    unsigned i;
+    if (dropped != 0) {
+        putc(DIAGCTX_OP_DROPPED, file);
+        diagctx_recorder_varint(file, dropped);
+    }
+    for (i = 0; i < count; ++i) {
+        diagctx_trace_event const* event = &events[i];
+        unsigned long long ticks = 0;
+        if (event->kind == DIAGCTX_TRACE_REPORT)
+            continue;
+        if (recorder->last_time != 0 && event->time > recorder->last_time)
+            ticks = event->time - recorder->last_time;
+        recorder->last_time = event->time;
+        switch (event->kind) {
+        case DIAGCTX_TRACE_PUSH:
+            if (event->type_id != (unsigned) -1 && diagctx_recorder_define(recorder, event->type_id)) {
+                char const* name = diagctx_type_name(event->type_id);
+                unsigned length = 0;
+                while (name[length] != '\0')
+                    ++length;
+                putc(DIAGCTX_OP_TYPE, file);
+                diagctx_recorder_varint(file, event->type_id);
+                diagctx_recorder_varint(file, diagctx_type_size(event->type_id));
+                diagctx_recorder_varint(file, length);
+                fwrite(name, 1, length, file);
+            }
+            putc(DIAGCTX_OP_PUSH, file);
+            diagctx_recorder_varint(file, event->type_id == (unsigned) -1 ? 0 : event->type_id + 1ULL);
+            break;
+        case DIAGCTX_TRACE_POP:
+            putc(DIAGCTX_OP_POP, file);
+            break;
+        case DIAGCTX_TRACE_UNWIND:
+            putc(DIAGCTX_OP_UNWIND, file);
+            diagctx_recorder_varint(file, event->depth);
+            break;
+        case DIAGCTX_TRACE_GET:
+            putc(DIAGCTX_OP_GET, file);
+            break;
+        }
+        diagctx_recorder_varint(file, ticks);
+    }
+}
+
+#endif
@@ -39,17 +39,186 @@ DEALINGS IN THE SOFTWARE.
 #endif
 
 #include <assert.h>
-#define NULL ((void*) 0)
+#include <stddef.h> /* offsetof() */
+#include <stdio.h> /* sprintf() */
+#include <stdlib.h> /* abort() */
+#include <string.h> /* memcpy() */
 
-struct diagctx_infos {
+#if defined(__AVX2__)
+#    include <immintrin.h>
+#    define DIAGCTX_AVX2
+#    define DIAGCTX_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    include <emmintrin.h>
+#    define DIAGCTX_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#    include <arm_neon.h>
+#    define DIAGCTX_NEON
+#endif
+#if defined(_MSC_VER) && (defined(DIAGCTX_SSE2) || defined(DIAGCTX_PROFILE))
+#    include <intrin.h>
+#endif
+
+#ifndef DIAGCTX_MAX_TYPES
+#    define DIAGCTX_MAX_TYPES 64
+#endif
+
+#define DIAGCTX_MAX_PATTERNS 32 /* see diagctx_register_pattern() */
+
+/* Constant of type diagctx_u64, whose suffix is only standard since C99. */
+#if defined(__GNUC__)
+#    define DIAGCTX_U64(constant) (__extension__ constant##ULL)
+#else
+#    define DIAGCTX_U64(constant) constant##ULL
+#endif
+
+/* With DIAGCTX_USDT, static tracepoints of the provider "diagctx" are compiled in (Linux, GCC or Clang,
+ * sys/sdt.h from SystemTap), for bpftrace, perf or SystemTap:
+ *     push(depth, message, type_id)   after diagctx_push() and diagctx_push_typed()
+ *     pop(depth, message, type_id)    before the message is destroyed by diagctx_pop()
+ *     get(depth, msg_id, buffer)      when diagctx_get() is called
+ * 'message' is NULL for messages which are not stored, 'type_id' is -1 for untyped messages.
+ * Each probe has a semaphore which is set by the tracer when attached: otherwise, the probe
+ * costs a load and a branch, and its arguments are not computed. */
+#ifdef DIAGCTX_USDT
+#    define _SDT_HAS_SEMAPHORES 1
+#    include <sys/sdt.h>
+#    define DIAGCTX_PROBE_SEMAPHORE(name) \
+         __extension__ unsigned short diagctx_##name##_semaphore __attribute__((unused, section(".probes")))
+#    define DIAGCTX_PROBE3(name, arg1, arg2, arg3) \
+         do { if (DIAGCTX_UNLIKELY(diagctx_##name##_semaphore)) STAP_PROBE3(diagctx, name, arg1, arg2, arg3); } while (0)
+DIAGCTX_PROBE_SEMAPHORE(push);
+DIAGCTX_PROBE_SEMAPHORE(pop);
+DIAGCTX_PROBE_SEMAPHORE(get);
+#else
+#    define DIAGCTX_PROBE3(name, arg1, arg2, arg3) do { } while (0)
+#endif
+
+/* With DIAGCTX_RSEQ (Linux on x86-64, GCC 11 or Clang 11 for the outputs of asm goto,
+ * glibc 2.35 or later which registers rseq), the counters of shared profile tables
+ * are updated by restartable sequences in the shard of the CPU.
+ * Otherwise, or when rseq is not registered, they are updated with atomics. */
+#if defined(DIAGCTX_RSEQ) && defined(DIAGCTX_PROFILE) && defined(__linux__) && defined(__x86_64__) \
+    && ((defined(__clang__) && __clang_major__ >= 11) || (!defined(__clang__) && __GNUC__ >= 11))
+#    include <sys/rseq.h>
+#    define DIAGCTX_RSEQ_X86_64
+#endif
+
+/* 'message_size == 0' means that diagctx_init_typed() was used. In this case,
+ * 'capacity' is the size of 'buffer' in bytes, and 'msg_destructor' is unused. */
+struct diagctx_context {
     char* buffer;
     unsigned capacity;
     unsigned message_size;
     unsigned current_id;
     void(*msg_destructor)(void*);
+    void* scratch;      /* returned instead of NULL when a push overflows */
+    unsigned stored;    /* number of stored messages, the other ones are NULL */
+    /* Only used for typed messages. */
+    unsigned top;       /* offset of the payload of the last stored message */
+    unsigned visited;   /* message given to the handler of diagctx_get(), for diagctx_type_of() */
+    unsigned generation; /* last generation given to a typed message, kept by diagctx_init_typed() */
+    diagctx_profile_entry* profile; /* NULL if not profiled */
+    unsigned profile_capacity;
+    unsigned profile_shards;    /* 0 if 'profile' is specific to this context */
+    /* Tail-based tracing, see diagctx_trace_init(). */
+    diagctx_trace_event* trace; /* NULL if not traced */
+    unsigned trace_capacity;
+    unsigned trace_next;        /* index of the next event in the ring */
+    int trace_full;             /* the ring wrapped around since the start of the request */
+    int trace_keep;             /* the request was reported */
+    diagctx_u64 trace_dropped;
+    diagctx_u64 trace_start;
+    diagctx_u64 trace_threshold;
+    diagctx_trace_sink_t* trace_sink;
+    void* trace_userdata;
 };
 
-static THREAD_LOCAL struct diagctx_infos diagctx = {0};
+/* Each thread uses its default context, unless another one is installed with diagctx_swap(). */
+static THREAD_LOCAL struct diagctx_context diagctx_default = {0};
+static THREAD_LOCAL struct diagctx_context* diagctx_installed = NULL;
+
+static struct diagctx_context* diagctx_current(void) {
+    struct diagctx_context* ctx = diagctx_installed;
+    return ctx != NULL ? ctx : &diagctx_default;
+}
+
+struct diagctx_type {
+    char const* name;
+    diagctx_u64 name_hash; /* FNV-1a, for the fingerprints of profiled paths */
+    unsigned size; /* rounded up to sizeof(union diagctx_align) */
+    unsigned footprint; /* size, plus the diagctx_usage sampled at push if enabled by diagctx_profile_usage() */
+    void(*msg_destructor)(void*);
+    diagctx_handler_t* renderer;
+    diagctx_u64 pattern_mask; /* states of the patterns entered by a message of this type */
+};
+
+static struct diagctx_type diagctx_types[DIAGCTX_MAX_TYPES];
+static unsigned diagctx_type_count = 0;
+
+/* The patterns are matched with the Shift-And algorithm: each pattern of n segments has n + 1 consecutive
+ * states, the state i being set when the path matches the first i segments. Pushing a message shifts the
+ * states by one, keeping the ones entered by its type, and '*' segments keep their state and may be skipped. */
+struct diagctx_pattern {
+    char const* text;
+    unsigned last; /* state of the whole pattern */
+    diagctx_trigger_t* trigger;
+    void* userdata;
+};
+
+static struct diagctx_pattern diagctx_patterns[DIAGCTX_MAX_PATTERNS];
+static unsigned diagctx_pattern_count = 0;
+static unsigned diagctx_pattern_states = 0;
+static diagctx_u64 diagctx_pattern_initial = 0; /* states of the empty path */
+static diagctx_u64 diagctx_pattern_star = 0;    /* states entered by a '*' segment */
+static diagctx_u64 diagctx_pattern_triggers = 0; /* states of the whole patterns with a trigger */
+
+static diagctx_clock_t* diagctx_clock = NULL;
+static diagctx_usage_sampler_t* diagctx_usage_sampler = NULL;
+
+/* Typed messages are split in two regions of the buffer: the headers are a dense array at the start,
+ * indexed by message, and the payloads are stacked down from the end. Walking the stored messages,
+ * such as for their types, only touches the cache lines of the headers. The payloads keep the
+ * alignment of any type, because their sizes are rounded up to sizeof(union diagctx_align). */
+struct diagctx_header {
+    unsigned type_id;
+    unsigned payload;  /* offset of the message in the buffer */
+    diagctx_u64 patterns; /* states of the patterns for the path up to this message */
+    unsigned generation; /* 0 once popped, read by other threads through handles */
+#ifdef DIAGCTX_PROFILE
+    unsigned entry;    /* index in the profile table, or -1 */
+    diagctx_u64 start;
+#endif
+};
+
+union diagctx_align { long double ld; double d; void* p; void(*f)(void); long l; };
+
+#define DIAGCTX_HEADERS(ctx) ((struct diagctx_header*)(ctx)->buffer)
+
+/* The generations of the headers are a seqlock for the readers of diagctx_handle_copy(): the writer clears
+ * the generation of a popped message before its payload can be reused, and readers check it after copying. */
+#if defined(__GNUC__)
+#    define DIAGCTX_GENERATION_STORE(header, value) __atomic_store_n(&(header)->generation, (value), __ATOMIC_RELAXED)
+#    define DIAGCTX_GENERATION_LOAD(header) __atomic_load_n(&(header)->generation, __ATOMIC_ACQUIRE)
+#    define DIAGCTX_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#    define DIAGCTX_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#elif defined(_MSC_VER)
+/* Volatile accesses have acquire and release semantics with MSVC on x86 and x64. */
+#    define DIAGCTX_GENERATION_STORE(header, value) (*(unsigned volatile*)&(header)->generation = (value))
+#    define DIAGCTX_GENERATION_LOAD(header) (*(unsigned volatile const*)&(header)->generation)
+#    define DIAGCTX_FENCE_RELEASE() _ReadWriteBarrier()
+#    define DIAGCTX_FENCE_ACQUIRE() _ReadWriteBarrier()
+#else
+#    define DIAGCTX_GENERATION_STORE(header, value) (*(unsigned volatile*)&(header)->generation = (value))
+#    define DIAGCTX_GENERATION_LOAD(header) (*(unsigned volatile const*)&(header)->generation)
+#    define DIAGCTX_FENCE_RELEASE() do { } while (0)
+#    define DIAGCTX_FENCE_ACQUIRE() do { } while (0)
+#endif
+
+static void diagctx_clear_generation(struct diagctx_header* header) {
+    DIAGCTX_GENERATION_STORE(header, 0);
+    DIAGCTX_FENCE_RELEASE();
+}
 
 
 void diagctx_init(unsigned message_size,
@@ -57,51 +226,1147 @@ void diagctx_init(unsigned message_size,
                   unsigned capacity,
                   void(*msg_destructor)(void*))
 {
+    struct diagctx_context* ctx = diagctx_current();
     assert(buffer != NULL && "[diagctx] buffer == NULL in initialization");
-    diagctx.message_size = message_size;
-    diagctx.msg_destructor = msg_destructor;
-    diagctx.current_id = 0;
-    diagctx.capacity = capacity;
+    ctx->message_size = message_size;
+    ctx->msg_destructor = msg_destructor;
+    ctx->current_id = 0;
+    ctx->capacity = capacity;
+    ctx->stored = 0;
+    ctx->scratch = NULL;
+    ctx->trace = NULL;
     
-    diagctx.buffer = (char*)buffer;
+    ctx->buffer = (char*)buffer;
+}
+
+void diagctx_init_typed(void* buffer, unsigned buffer_size) {
+    struct diagctx_context* ctx = diagctx_current();
+    assert(buffer != NULL && "[diagctx] buffer == NULL in initialization");
+    ctx->message_size = 0;
+    ctx->msg_destructor = NULL;
+    ctx->current_id = 0;
+    ctx->capacity = buffer_size;
+    ctx->stored = 0;
+    ctx->top = buffer_size / sizeof(union diagctx_align) * sizeof(union diagctx_align);
+    ctx->visited = 0;
+    ctx->profile = NULL;
+    ctx->scratch = NULL;
+    ctx->trace = NULL;
+
+    ctx->buffer = (char*)buffer;
+}
+
+/* Set in 'states' the states of pattern 'p' entered by a message named 'name', or by any message if 'name'
+ * is NULL, and return the number of segments. Consecutive '*' are a single segment. The first state of 'p'
+ * is the one after the pattern registered before. Scanning stops at the 64th state, so that no bit
+ * beyond the masks is set, and the returned count then makes diagctx_register_pattern() reject 'p'. */
+static unsigned diagctx_pattern_scan(struct diagctx_pattern const* p, char const* name, diagctx_u64* states) {
+    unsigned first = p == diagctx_patterns ? 0 : p[-1].last + 1;
+    unsigned segments = 0;
+    int previous_star = 0;
+    char const* c = p->text;
+    for (;;) {
+        char const* begin;
+        unsigned size;
+        while (*c == ' ' || *c == '\t')
+            ++c;
+        if (*c == '\0')
+            break;
+        begin = c;
+        while (*c != '\0' && *c != '>')
+            ++c;
+        size = (unsigned)(c - begin);
+        while (size > 0 && (begin[size - 1] == ' ' || begin[size - 1] == '\t'))
+            --size;
+        if (*c == '>')
+            ++c;
+        if (size == 1 && *begin == '*' && previous_star)
+            continue;
+        if (first + segments + 1 >= 64)
+            return 64 - first;
+        ++segments;
+        if (size == 1 && *begin == '*') {
+            previous_star = 1;
+            *states |= (diagctx_u64)1 << (first + segments);
+        } else {
+            previous_star = 0;
+            if (name != NULL && strncmp(name, begin, size) == 0 && name[size] == '\0')
+                *states |= (diagctx_u64)1 << (first + segments);
+        }
+    }
+    return segments;
+}
+
+unsigned diagctx_register_type(char const* name,
+                               unsigned size,
+                               void(*msg_destructor)(void*),
+                               diagctx_handler_t* renderer)
+{
+    struct diagctx_type* type;
+    char const* c;
+    unsigned i;
+    assert(diagctx_type_count < DIAGCTX_MAX_TYPES && "[diagctx] too many types, DIAGCTX_MAX_TYPES must be increased");
+    type = &diagctx_types[diagctx_type_count];
+    type->name = name;
+    type->name_hash = DIAGCTX_U64(0xcbf29ce484222325);
+    for (c = name; *c != '\0'; ++c)
+        type->name_hash = (type->name_hash ^ (unsigned char)*c) * DIAGCTX_U64(0x100000001b3);
+    type->size = (size + sizeof(union diagctx_align) - 1) / sizeof(union diagctx_align) * sizeof(union diagctx_align);
+    type->footprint = type->size;
+    type->msg_destructor = msg_destructor;
+    type->renderer = renderer;
+    type->pattern_mask = 0;
+    for (i = 0; i < diagctx_pattern_count; ++i)
+        diagctx_pattern_scan(&diagctx_patterns[i], name, &type->pattern_mask);
+    return diagctx_type_count++;
+}
+
+unsigned diagctx_register_pattern(char const* pattern, diagctx_trigger_t* trigger, void* userdata) {
+    struct diagctx_pattern* p;
+    diagctx_u64 star = 0;
+    unsigned i;
+    assert(diagctx_pattern_count < DIAGCTX_MAX_PATTERNS && "[diagctx] too many patterns");
+    if (diagctx_pattern_count == DIAGCTX_MAX_PATTERNS)
+        return (unsigned)-1;
+    p = &diagctx_patterns[diagctx_pattern_count];
+    p->text = pattern;
+    p->last = diagctx_pattern_states + diagctx_pattern_scan(p, NULL, &star);
+    p->trigger = trigger;
+    p->userdata = userdata;
+    assert(p->last < 64 && "[diagctx] too many segments in the patterns");
+    if (p->last >= 64)
+        return (unsigned)-1;
+    for (i = 0; i < diagctx_type_count; ++i)
+        diagctx_pattern_scan(p, diagctx_types[i].name, &diagctx_types[i].pattern_mask);
+    diagctx_pattern_star |= star;
+    diagctx_pattern_initial |= (diagctx_u64)1 << diagctx_pattern_states;
+    diagctx_pattern_initial |= (diagctx_pattern_initial << 1) & diagctx_pattern_star;
+    if (trigger != NULL)
+        diagctx_pattern_triggers |= (diagctx_u64)1 << p->last;
+    diagctx_pattern_states = p->last + 1;
+    return diagctx_pattern_count++;
+}
+
+int diagctx_match(unsigned pattern_id) {
+    struct diagctx_context* ctx = diagctx_current();
+    diagctx_u64 states = diagctx_pattern_initial;
+    assert(ctx->message_size == 0 && "[diagctx] diagctx_match() used without diagctx_init_typed()");
+    assert(pattern_id < diagctx_pattern_count && "[diagctx] unregistered pattern in diagctx_match()");
+    if (pattern_id >= diagctx_pattern_count)
+        return 0;
+    if (ctx->stored != 0)
+        states = DIAGCTX_HEADERS(ctx)[ctx->stored - 1].patterns;
+    return (int)((states >> diagctx_patterns[pattern_id].last) & 1);
+}
+
+/* Call the triggers of the patterns whose state is set in 'entered'. */
+static DIAGCTX_COLD void diagctx_pattern_trigger(diagctx_u64 entered, unsigned msg_id) {
+    unsigned i;
+    for (i = 0; i < diagctx_pattern_count; ++i) {
+        struct diagctx_pattern const* p = &diagctx_patterns[i];
+        if (p->trigger != NULL && ((entered >> p->last) & 1))
+            (*p->trigger)(p->userdata, msg_id);
+    }
+}
+
+#ifdef DIAGCTX_PROFILE
+/* Relaxed atomics for the tables shared with diagctx_profile_init_shared(). */
+static diagctx_u64 diagctx_atomic_load(diagctx_u64* value) {
+#    if defined(__GNUC__)
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+#    elif defined(_MSC_VER)
+    return (diagctx_u64) _InterlockedCompareExchange64((__int64 volatile*) value, 0, 0);
+#    else
+    return *value;
+#    endif
+}
+
+/* Replace '*value' by 'desired' if it is '*expected', otherwise set '*expected' to '*value'. */
+static int diagctx_atomic_cas(diagctx_u64* value, diagctx_u64* expected, diagctx_u64 desired) {
+#    if defined(__GNUC__)
+    return __atomic_compare_exchange_n(value, expected, desired, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+#    elif defined(_MSC_VER)
+    diagctx_u64 previous = (diagctx_u64) _InterlockedCompareExchange64((__int64 volatile*) value,
+                                                                                    (__int64) desired, (__int64) *expected);
+    if (previous == *expected)
+        return 1;
+    *expected = previous;
+    return 0;
+#    else
+    if (*value != *expected) {
+        *expected = *value;
+        return 0;
+    }
+    *value = desired;
+    return 1;
+#    endif
+}
+
+#    ifdef DIAGCTX_RSEQ_X86_64
+static struct rseq* diagctx_rseq(void) {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/* A restartable sequence from label 1 to label 2, whose descriptor is label 3: the kernel jumps to label 4,
+ * after the signature, if the thread is preempted, migrated or signaled before the commit at label 2. */
+#        define DIAGCTX_RSEQ_BEGIN \
+             ".pushsection __rseq_cs, \"aw\"\n\t" \
+             ".balign 32\n\t" \
+             "3:\n\t" \
+             ".long 0, 0\n\t" \
+             ".quad 1f, 2f - 1f, 4f\n\t" \
+             ".popsection\n\t" \
+             "leaq 3b(%%rip), %%rax\n\t" \
+             "movq %%rax, %[rseq_cs]\n\t" \
+             "1:\n\t" \
+             "cmpl %[cpu], %[cpu_id]\n\t" \
+             "jnz %l[aborted]\n\t"
+#        define DIAGCTX_RSEQ_END \
+             "2:\n\t" \
+             ".pushsection __rseq_failure, \"ax\"\n\t" \
+             ".long %c[signature]\n\t" \
+             "4:\n\t" \
+             "jmp %l[aborted]\n\t" \
+             ".popsection\n\t"
+
+/* Add 'value' to '*counter' if the thread still runs on 'cpu'. Returns 0 if the sequence was aborted. */
+static int diagctx_rseq_add(struct rseq* rs, unsigned cpu, diagctx_u64* counter, diagctx_u64 value) {
+    __asm__ __volatile__ goto (
+        DIAGCTX_RSEQ_BEGIN
+        "addq %[value], %[counter]\n\t"
+        DIAGCTX_RSEQ_END
+        : [rseq_cs] "=m" (rs->rseq_cs), [counter] "+m" (*counter)
+        : [cpu_id] "m" (rs->cpu_id), [cpu] "r" (cpu), [signature] "i" (RSEQ_SIG), [value] "r" (value)
+        : "memory", "cc", "rax"
+        : aborted);
+    return 1;
+aborted:
+    return 0;
+}
+
+static int diagctx_rseq_add_double(struct rseq* rs, unsigned cpu, double* counter, double value) {
+    __asm__ __volatile__ goto (
+        DIAGCTX_RSEQ_BEGIN
+        "movsd %[counter], %%xmm0\n\t"
+        "addsd %[value], %%xmm0\n\t"
+        "movsd %%xmm0, %[counter]\n\t"
+        DIAGCTX_RSEQ_END
+        : [rseq_cs] "=m" (rs->rseq_cs), [counter] "+m" (*counter)
+        : [cpu_id] "m" (rs->cpu_id), [cpu] "r" (cpu), [signature] "i" (RSEQ_SIG), [value] "x" (value)
+        : "memory", "cc", "rax", "xmm0"
+        : aborted);
+    return 1;
+aborted:
+    return 0;
+}
+#    endif
+
+/* Shard of a shared table updated by the calling thread with atomics. With rseq, the last shard is
+ * for the CPUs without their own shard. Otherwise, threads are spread by the address of their thread-local storage. */
+static unsigned diagctx_atomic_shard(struct diagctx_context* ctx) {
+#    ifdef DIAGCTX_RSEQ_X86_64
+    if (__rseq_size != 0)
+        return ctx->profile_shards - 1;
+#    endif
+    return (unsigned)((((diagctx_u64)(size_t)&diagctx_default * DIAGCTX_U64(0x9E3779B97F4A7C15)) >> 32) % ctx->profile_shards);
+}
+
+/* Add 'value' to the counter at 'offset' in the entry 'index' of the profile. In a shared table,
+ * the shard of the CPU is updated by a restartable sequence if possible, otherwise another one with atomics. */
+static void diagctx_profile_add(struct diagctx_context* ctx, unsigned index, size_t offset, diagctx_u64 value) {
+    diagctx_u64* counter;
+    if (ctx->profile_shards == 0) {
+        *(diagctx_u64*)((char*)&ctx->profile[index] + offset) += value;
+        return;
+    }
+#    ifdef DIAGCTX_RSEQ_X86_64
+    if (__rseq_size != 0) {
+        struct rseq* rs = diagctx_rseq();
+        for (;;) {
+            unsigned cpu = *(unsigned volatile*)&rs->cpu_id_start;
+            if (cpu >= ctx->profile_shards - 1)
+                break;
+            counter = (diagctx_u64*)((char*)&ctx->profile[cpu * ctx->profile_capacity + index] + offset);
+            if (diagctx_rseq_add(rs, cpu, counter, value))
+                return;
+        }
+    }
+#    endif
+    counter = (diagctx_u64*)((char*)&ctx->profile[diagctx_atomic_shard(ctx) * ctx->profile_capacity + index] + offset);
+#    if defined(__GNUC__)
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#    elif defined(_MSC_VER)
+    _InterlockedExchangeAdd64((__int64 volatile*) counter, (__int64) value);
+#    else
+    *counter += value;
+#    endif
+}
+
+static void diagctx_profile_add_squares(struct diagctx_context* ctx, unsigned index, double value) {
+    diagctx_u64* bits;
+    diagctx_u64 expected, desired;
+    double sum;
+    if (ctx->profile_shards == 0) {
+        ctx->profile[index].total_squares += value;
+        return;
+    }
+#    ifdef DIAGCTX_RSEQ_X86_64
+    if (__rseq_size != 0) {
+        struct rseq* rs = diagctx_rseq();
+        for (;;) {
+            unsigned cpu = *(unsigned volatile*)&rs->cpu_id_start;
+            if (cpu >= ctx->profile_shards - 1)
+                break;
+            if (diagctx_rseq_add_double(rs, cpu, &ctx->profile[cpu * ctx->profile_capacity + index].total_squares, value))
+                return;
+        }
+    }
+#    endif
+    /* There is no atomic addition of doubles, so the bits are replaced with a compare-and-swap. */
+    bits = (diagctx_u64*)&ctx->profile[diagctx_atomic_shard(ctx) * ctx->profile_capacity + index].total_squares;
+    expected = diagctx_atomic_load(bits);
+    do {
+        memcpy(&sum, &expected, sizeof(sum));
+        sum += value;
+        memcpy(&desired, &sum, sizeof(sum));
+    } while (!diagctx_atomic_cas(bits, &expected, desired));
+}
+
+/* Add the usage since 'start', sampled at push, to the entry 'index'. */
+static void diagctx_profile_add_usage(struct diagctx_context* ctx, unsigned index, diagctx_usage const* start) {
+    diagctx_usage now;
+    (*diagctx_usage_sampler)(&now);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage_count), 1);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage.cpu_time), now.cpu_time - start->cpu_time);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage.minor_faults), now.minor_faults - start->minor_faults);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage.major_faults), now.major_faults - start->major_faults);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage.voluntary_switches),
+                        now.voluntary_switches - start->voluntary_switches);
+    diagctx_profile_add(ctx, index, offsetof(diagctx_profile_entry, usage.involuntary_switches),
+                        now.involuntary_switches - start->involuntary_switches);
+}
+
+/* Return the entry of the path of 'type_id' under 'parent', creating it if needed, or -1 if the table is full.
+ * The table is an open addressing hash table on the fingerprints, so entries never move.
+ * In a shared table, paths are only in the first shard, and they are claimed with a compare-and-swap. */
+static unsigned diagctx_profile_find(struct diagctx_context* ctx, unsigned parent, unsigned type_id) {
+    diagctx_profile_entry* entries = ctx->profile;
+    diagctx_u64 path = parent == (unsigned)-1 ? DIAGCTX_U64(0x84222325cbf29ce4) : entries[parent].path;
+    unsigned i, n;
+    /* splitmix64 finalizer, so that "a;b" and "b;a" differ */
+    path = (path ^ diagctx_types[type_id].name_hash) + DIAGCTX_U64(0x9e3779b97f4a7c15);
+    path = (path ^ (path >> 30)) * DIAGCTX_U64(0xbf58476d1ce4e5b9);
+    path = (path ^ (path >> 27)) * DIAGCTX_U64(0x94d049bb133111eb);
+    path = (path ^ (path >> 31)) | 1; /* 0 is a free entry */
+    i = (unsigned)(path % ctx->profile_capacity);
+    for (n = 0; n < ctx->profile_capacity; ++n) {
+        diagctx_u64 current = ctx->profile_shards != 0 ? diagctx_atomic_load(&entries[i].path) : entries[i].path;
+        if (current == 0 && (ctx->profile_shards == 0 || diagctx_atomic_cas(&entries[i].path, &current, path))) {
+            if (ctx->profile_shards == 0)
+                entries[i].path = path;
+            entries[i].parent = parent;
+            entries[i].type_id = type_id;
+            return i;
+        }
+        if (current == path)
+            return i;
+        if (++i == ctx->profile_capacity)
+            i = 0;
+    }
+    return (unsigned)-1;
+}
+#endif
+
+#ifdef DIAGCTX_TRACE
+static void diagctx_trace_record(struct diagctx_context* ctx, unsigned kind, unsigned depth, unsigned type_id,
+                                 char const* text)
+{
+    diagctx_trace_event* event = &ctx->trace[ctx->trace_next];
+    if (ctx->trace_full)
+        ++ctx->trace_dropped;
+    event->time = diagctx_clock != NULL ? (*diagctx_clock)() : 0;
+    event->kind = kind;
+    event->depth = depth;
+    event->type_id = type_id;
+    event->text = text;
+    if (kind == DIAGCTX_TRACE_PUSH && depth == 1)
+        ctx->trace_start = event->time;
+    if (++ctx->trace_next == ctx->trace_capacity) {
+        ctx->trace_next = 0;
+        ctx->trace_full = 1;
+    }
+}
+
+static void diagctx_trace_reverse(diagctx_trace_event* events, unsigned begin, unsigned end) {
+    while (end - begin > 1) {
+        diagctx_trace_event tmp = events[begin];
+        events[begin++] = events[--end];
+        events[end] = tmp;
+    }
 }
 
+/* Called when no message remains: give the events of the request to the sink if it is kept, and reset the ring.
+ * Only kept requests pay for putting the ring in order. */
+static void diagctx_trace_end(struct diagctx_context* ctx) {
+    diagctx_trace_event* events = ctx->trace;
+    unsigned count = ctx->trace_full ? ctx->trace_capacity : ctx->trace_next;
+    unsigned last = (ctx->trace_next + ctx->trace_capacity - 1) % ctx->trace_capacity;
+    if (count != 0 && (ctx->trace_keep || events[last].time - ctx->trace_start >= ctx->trace_threshold)) {
+        if (ctx->trace_full) {
+            diagctx_trace_reverse(events, 0, ctx->trace_next);
+            diagctx_trace_reverse(events, ctx->trace_next, ctx->trace_capacity);
+            diagctx_trace_reverse(events, 0, ctx->trace_capacity);
+        }
+        ctx->trace = NULL; /* messages pushed by the sink are not traced */
+        (*ctx->trace_sink)(ctx->trace_userdata, events, count, ctx->trace_dropped);
+        ctx->trace = events;
+    }
+    ctx->trace_next = 0;
+    ctx->trace_full = 0;
+    ctx->trace_keep = 0;
+    ctx->trace_dropped = 0;
+}
+
+#    define DIAGCTX_TRACE_RECORD(ctx, kind, depth, type_id, text) \
+         do { if ((ctx)->trace != NULL) diagctx_trace_record((ctx), (kind), (depth), (type_id), (text)); } while (0)
+#    define DIAGCTX_TRACE_END(ctx) \
+         do { if ((ctx)->trace != NULL) diagctx_trace_end(ctx); } while (0)
+#else
+#    define DIAGCTX_TRACE_RECORD(ctx, kind, depth, type_id, text) do { } while (0)
+#    define DIAGCTX_TRACE_END(ctx) do { } while (0)
+#endif
+
 void* diagctx_push(unsigned* msg_id) {
-    unsigned id = diagctx.current_id++;
-    *msg_id = diagctx.current_id;
-    if (id < diagctx.capacity)
-        return diagctx.buffer + diagctx.message_size * id;
-    else
-        return NULL;
+    struct diagctx_context* ctx = diagctx_current();
+    unsigned id = ctx->current_id++;
+    void* msg;
+    assert(ctx->message_size != 0 && "[diagctx] diagctx_push() used after diagctx_init_typed(), use diagctx_push_typed()");
+    *msg_id = ctx->current_id;
+    msg = NULL;
+    if (id == ctx->stored && id < ctx->capacity) {
+        msg = ctx->buffer + ctx->message_size * id;
+        ++ctx->stored;
+    }
+    DIAGCTX_PROBE3(push, ctx->current_id, msg, (unsigned)-1);
+    DIAGCTX_TRACE_RECORD(ctx, DIAGCTX_TRACE_PUSH, ctx->current_id, (unsigned)-1, NULL);
+    return msg != NULL ? msg : ctx->scratch;
+}
+
+void* diagctx_push_typed(unsigned type_id, unsigned* msg_id) {
+    struct diagctx_context* ctx = diagctx_current();
+    unsigned id = ctx->current_id++;
+    unsigned size, headers_end;
+    struct diagctx_header* header;
+    assert(ctx->message_size == 0 && "[diagctx] diagctx_push_typed() used without diagctx_init_typed()");
+    assert(type_id < diagctx_type_count && "[diagctx] unregistered type in diagctx_push_typed()");
+    *msg_id = ctx->current_id;
+    DIAGCTX_TRACE_RECORD(ctx, DIAGCTX_TRACE_PUSH, ctx->current_id, type_id, NULL);
+    size = diagctx_types[type_id].footprint;
+    headers_end = (unsigned)sizeof(struct diagctx_header) * (id + 1);
+    if (id != ctx->stored || ctx->top < headers_end || ctx->top - headers_end < size) {
+        DIAGCTX_PROBE3(push, ctx->current_id, NULL, type_id);
+        return ctx->scratch;
+    }
+    
+    header = DIAGCTX_HEADERS(ctx) + id;
+    header->type_id = type_id;
+    if (++ctx->generation == 0)
+        ctx->generation = 1;
+    DIAGCTX_GENERATION_STORE(header, ctx->generation);
+#ifdef DIAGCTX_PROFILE
+    header->entry = (unsigned)-1;
+    if (ctx->profile != NULL && diagctx_clock != NULL) {
+        unsigned parent = id == 0 ? (unsigned)-1 : header[-1].entry;
+        if (id == 0 || parent != (unsigned)-1)
+            header->entry = diagctx_profile_find(ctx, parent, type_id);
+        header->start = (*diagctx_clock)();
+    }
+#endif
+    ctx->top -= size;
+    header->payload = ctx->top;
+#ifdef DIAGCTX_PROFILE
+    if (size != diagctx_types[type_id].size && header->entry != (unsigned)-1 && diagctx_usage_sampler != NULL)
+        (*diagctx_usage_sampler)((diagctx_usage*)(ctx->buffer + ctx->top + diagctx_types[type_id].size));
+#endif
+    ++ctx->stored;
+    DIAGCTX_PROBE3(push, ctx->current_id, ctx->buffer + ctx->top, type_id);
+    if (diagctx_pattern_count != 0) {
+        diagctx_u64 previous = id == 0 ? diagctx_pattern_initial : header[-1].patterns;
+        diagctx_u64 states = ((previous << 1) & diagctx_types[type_id].pattern_mask) | (previous & diagctx_pattern_star);
+        states |= (states << 1) & diagctx_pattern_star;
+        header->patterns = states;
+        if (DIAGCTX_UNLIKELY(states & ~previous & diagctx_pattern_triggers))
+            diagctx_pattern_trigger(states & ~previous, ctx->current_id);
+    }
+    return ctx->buffer + ctx->top;
+}
+
+/* Stored typed messages are always the first ones, so 'id' is the last stored message if 'id < stored'. */
+static void diagctx_pop_typed(struct diagctx_context* ctx, unsigned id) {
+    if (id < ctx->stored) {
+        struct diagctx_header* header = DIAGCTX_HEADERS(ctx) + id;
+        struct diagctx_type const* type = &diagctx_types[header->type_id];
+        diagctx_clear_generation(header);
+        if (type->msg_destructor != NULL)
+            (*type->msg_destructor)(ctx->buffer + header->payload);
+#ifdef DIAGCTX_PROFILE
+        if (header->entry != (unsigned)-1 && diagctx_clock != NULL) {
+            diagctx_u64 elapsed = (*diagctx_clock)() - header->start;
+            diagctx_profile_add(ctx, header->entry, offsetof(diagctx_profile_entry, count), 1);
+            diagctx_profile_add(ctx, header->entry, offsetof(diagctx_profile_entry, total), elapsed);
+            diagctx_profile_add_squares(ctx, header->entry, (double)elapsed * (double)elapsed);
+            if (type->footprint != type->size && diagctx_usage_sampler != NULL)
+                diagctx_profile_add_usage(ctx, header->entry, (diagctx_usage const*)(ctx->buffer + header->payload + type->size));
+        }
+#endif
+        ctx->top = header->payload + type->footprint;
+        --ctx->stored;
+    }
+}
+
+#ifdef DIAGCTX_USDT
+/* Message 'id', which must be the last one, or NULL if it is not stored. */
+static void* diagctx_last_message(struct diagctx_context* ctx, unsigned id) {
+    if (ctx->message_size != 0)
+        return id < ctx->stored ? ctx->buffer + ctx->message_size * id : NULL;
+    return id < ctx->stored ? ctx->buffer + ctx->top : NULL;
 }
+#endif
+
+#if defined(DIAGCTX_USDT) || defined(DIAGCTX_TRACE)
+static unsigned diagctx_last_type(struct diagctx_context* ctx, unsigned id) {
+    return ctx->message_size == 0 && id < ctx->stored ? DIAGCTX_HEADERS(ctx)[id].type_id : (unsigned)-1;
+}
+#endif
 
 void diagctx_pop(unsigned msg_id) {
-    assert(diagctx.current_id == msg_id && "[diagctx] mismatch in diagctx_pop(), an intermediate diagctx_pop() have been missed.");
-    unsigned id = --diagctx.current_id;
-    if (diagctx.msg_destructor != NULL && id < diagctx.capacity)
-        (*diagctx.msg_destructor)(diagctx.buffer + diagctx.message_size * id);
+    struct diagctx_context* ctx = diagctx_current();
+    unsigned id;
+    assert(ctx->current_id == msg_id && "[diagctx] mismatch in diagctx_pop(), an intermediate diagctx_pop() have been missed.");
+    id = --ctx->current_id;
+    DIAGCTX_PROBE3(pop, msg_id, diagctx_last_message(ctx, id), diagctx_last_type(ctx, id));
+    DIAGCTX_TRACE_RECORD(ctx, DIAGCTX_TRACE_POP, msg_id, diagctx_last_type(ctx, id), NULL);
+    if (ctx->message_size == 0)
+        diagctx_pop_typed(ctx, id);
+    else if (id < ctx->stored) {
+        if (ctx->msg_destructor != NULL)
+            (*ctx->msg_destructor)(ctx->buffer + ctx->message_size * id);
+        --ctx->stored;
+    }
+    if (id == 0)
+        DIAGCTX_TRACE_END(ctx);
+}
+
+static void diagctx_get_typed(struct diagctx_context* ctx, unsigned msg_id, diagctx_handler_t* handler, void* userdata) {
+    /* These are copied locally to ensure that the context is accessed only once. */
+    char* buffer = ctx->buffer;
+    struct diagctx_header* headers = DIAGCTX_HEADERS(ctx);
+    unsigned stored = ctx->stored;
+    
+    unsigned i = 0, imax = ctx->current_id;
+    for (; i < imax; ++i) {
+        void* msg_ptr = NULL;
+        void(*msg_destructor)(void*) = NULL;
+        if (i < stored) {
+            struct diagctx_type const* type = &diagctx_types[headers[i].type_id];
+            msg_ptr = buffer + headers[i].payload;
+            msg_destructor = type->msg_destructor;
+            if (i == msg_id) /* the messages are truncated here */
+                ctx->top = headers[i].payload + type->footprint;
+        }
+        if (handler) {
+            ctx->visited = i;
+            (*handler)(userdata, msg_ptr);
+        }
+        if (i < stored && i >= msg_id)
+            diagctx_clear_generation(&headers[i]);
+        if (msg_destructor != NULL && i >= msg_id)
+            (*msg_destructor)(msg_ptr);
+    }
+    if (msg_id != (unsigned)-1) {
+        ctx->current_id = msg_id;
+        if (msg_id < stored)
+            ctx->stored = msg_id;
+    }
 }
 
 void diagctx_get(unsigned msg_id, diagctx_handler_t* handler, void* userdata) {
-    assert((msg_id == (unsigned)-1 || msg_id <= diagctx.current_id) && "[diagctx] incoherent msg_id in diagctx_get...");
+    struct diagctx_context* ctx = diagctx_current();
+    unsigned stored, message_size, i, imax;
+    char* buffer;
+    void(*msg_destructor)(void*);
+    assert((msg_id == (unsigned)-1 || msg_id <= ctx->current_id) && "[diagctx] incoherent msg_id in diagctx_get...");
+    DIAGCTX_PROBE3(get, ctx->current_id, msg_id, ctx->buffer);
+    /* Outside of a request, no event is recorded, as it would be kept with the next request. */
+    if (handler != NULL && ctx->current_id != 0)
+        DIAGCTX_TRACE_RECORD(ctx, DIAGCTX_TRACE_GET, ctx->current_id, (unsigned)-1, NULL);
+    if (msg_id < ctx->current_id)
+        DIAGCTX_TRACE_RECORD(ctx, DIAGCTX_TRACE_UNWIND, msg_id, (unsigned)-1, NULL);
+    if (ctx->message_size == 0) {
+        diagctx_get_typed(ctx, msg_id, handler, userdata);
+        if (msg_id == 0)
+            DIAGCTX_TRACE_END(ctx);
+        return;
+    }
     
-    /* These are copied locally to ensure that thread_local access are done only once. */
-    unsigned capacity = diagctx.capacity;
-    unsigned message_size = diagctx.message_size;
-    char* buffer = diagctx.buffer;
-    void(*msg_destructor)(void*) = diagctx.msg_destructor;
+    /* These are copied locally to ensure that the context is accessed only once. */
+    stored = ctx->stored;
+    message_size = ctx->message_size;
+    buffer = ctx->buffer;
+    msg_destructor = ctx->msg_destructor;
     
-    unsigned i = 0, imax = diagctx.current_id;
-    for (; i < imax; ++i) {
-        void* msg_ptr = (i >= capacity) ? NULL : buffer + message_size * i;
+    imax = ctx->current_id;
+    for (i = 0; i < imax; ++i) {
+        void* msg_ptr = (i >= stored) ? NULL : buffer + message_size * i;
         if (handler)
             (*handler)(userdata, msg_ptr); 
         if (msg_destructor != NULL && i >= msg_id && msg_ptr != NULL)
             (*msg_destructor)(msg_ptr);
     }
-    if (msg_id != (unsigned)-1)
-        diagctx.current_id = msg_id;
+    if (msg_id != (unsigned)-1) {
+        ctx->current_id = msg_id;
+        if (msg_id < stored)
+            ctx->stored = msg_id;
+    }
+    if (msg_id == 0)
+        DIAGCTX_TRACE_END(ctx);
 }
 
+void diagctx_set_profile_clock(diagctx_clock_t* clock) {
+    diagctx_clock = clock;
+}
 
+void diagctx_set_profile_usage(diagctx_usage_sampler_t* sampler) {
+    diagctx_usage_sampler = sampler;
+}
+
+void diagctx_profile_usage(unsigned type_id) {
+    assert(type_id < diagctx_type_count && "[diagctx] unregistered type in diagctx_profile_usage()");
+#ifdef DIAGCTX_PROFILE
+    diagctx_types[type_id].footprint = diagctx_types[type_id].size +
+        (unsigned)((sizeof(diagctx_usage) + sizeof(union diagctx_align) - 1) / sizeof(union diagctx_align) * sizeof(union diagctx_align));
+#endif
+}
 
+void diagctx_profile_init(diagctx_profile_entry* entries, unsigned capacity) {
+    struct diagctx_context* ctx = diagctx_current();
+    assert(ctx->message_size == 0 && "[diagctx] diagctx_profile_init() used without diagctx_init_typed()");
+    assert((entries == NULL || capacity > 0) && "[diagctx] empty profile table in diagctx_profile_init()");
+    if (entries != NULL)
+        memset(entries, 0, sizeof(diagctx_profile_entry) * capacity);
+    ctx->profile = entries;
+    ctx->profile_capacity = capacity;
+    ctx->profile_shards = 0;
+}
+
+void diagctx_profile_init_shared(diagctx_profile_entry* entries, unsigned capacity, unsigned shards) {
+    struct diagctx_context* ctx = diagctx_current();
+    assert(ctx->message_size == 0 && "[diagctx] diagctx_profile_init_shared() used without diagctx_init_typed()");
+    assert((entries == NULL || (capacity > 0 && shards > 0)) && "[diagctx] empty profile table in diagctx_profile_init_shared()");
+    ctx->profile = entries;
+    ctx->profile_capacity = capacity;
+    ctx->profile_shards = shards;
+}
+
+void diagctx_profile_alloc(diagctx_u64 size) {
+#ifdef DIAGCTX_PROFILE
+    struct diagctx_context* ctx = diagctx_current();
+    if (ctx->message_size == 0 && ctx->profile != NULL && ctx->stored != 0) {
+        unsigned entry = DIAGCTX_HEADERS(ctx)[ctx->stored - 1].entry;
+        if (entry != (unsigned)-1) {
+            diagctx_profile_add(ctx, entry, offsetof(diagctx_profile_entry, alloc_count), 1);
+            diagctx_profile_add(ctx, entry, offsetof(diagctx_profile_entry, alloc_bytes), size);
+        }
+    }
+#else
+    (void) size;
+#endif
+}
+
+/* Write the type names of the path of 'index', from the first message. */
+static void diagctx_profile_write_path(diagctx_profile_entry const* entries, unsigned index, unsigned depth,
+                                       diagctx_write_t* write, void* userdata)
+{
+    char const* name = diagctx_types[entries[index].type_id].name;
+    if (entries[index].parent != (unsigned)-1) {
+        if (depth < 256)
+            diagctx_profile_write_path(entries, entries[index].parent, depth + 1, write, userdata);
+        else
+            (*write)(userdata, "...", 3);
+        (*write)(userdata, ";", 1);
+    }
+    (*write)(userdata, name, (unsigned)strlen(name));
+}
+
+/* Write 'value' in base 10 or 16 with at least 'width' digits and a trailing space, as the
+ * "ll" length modifier of sprintf() is only standard since C99. Returns the end of the text. */
+static char* diagctx_format_u64(char* out, diagctx_u64 value, unsigned base, unsigned width) {
+    char digits[20];
+    unsigned count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0 || count < width);
+    while (count != 0)
+        *out++ = digits[--count];
+    *out++ = ' ';
+    return out;
+}
+
+void diagctx_profile_dump(diagctx_write_t* write, void* userdata) {
+    struct diagctx_context* ctx = diagctx_current();
+    diagctx_profile_entry const* entries = ctx->profile;
+    unsigned i;
+    (*write)(userdata, "# diagctx profile 2\n", 20);
+    if (ctx->message_size != 0 || entries == NULL)
+        return;
+    for (i = 0; i < ctx->profile_capacity; ++i) {
+        char line[320];
+        char* end;
+        diagctx_profile_entry entry = entries[i];
+        unsigned shard;
+        if (entry.path == 0)
+            continue;
+        for (shard = 1; shard < ctx->profile_shards; ++shard) {
+            diagctx_profile_entry const* other = &entries[shard * ctx->profile_capacity + i];
+            entry.count += other->count;
+            entry.total += other->total;
+            entry.total_squares += other->total_squares;
+            entry.alloc_count += other->alloc_count;
+            entry.alloc_bytes += other->alloc_bytes;
+            entry.usage_count += other->usage_count;
+            entry.usage.cpu_time += other->usage.cpu_time;
+            entry.usage.minor_faults += other->usage.minor_faults;
+            entry.usage.major_faults += other->usage.major_faults;
+            entry.usage.voluntary_switches += other->usage.voluntary_switches;
+            entry.usage.involuntary_switches += other->usage.involuntary_switches;
+        }
+        end = diagctx_format_u64(line, entry.path, 16, 16);
+        end = diagctx_format_u64(end, entry.count, 10, 1);
+        end = diagctx_format_u64(end, entry.total, 10, 1);
+        end += sprintf(end, "%.17g ", entry.total_squares);
+        end = diagctx_format_u64(end, entry.alloc_count, 10, 1);
+        end = diagctx_format_u64(end, entry.alloc_bytes, 10, 1);
+        end = diagctx_format_u64(end, entry.usage_count, 10, 1);
+        end = diagctx_format_u64(end, entry.usage.cpu_time, 10, 1);
+        end = diagctx_format_u64(end, entry.usage.minor_faults, 10, 1);
+        end = diagctx_format_u64(end, entry.usage.major_faults, 10, 1);
+        end = diagctx_format_u64(end, entry.usage.voluntary_switches, 10, 1);
+        end = diagctx_format_u64(end, entry.usage.involuntary_switches, 10, 1);
+        (*write)(userdata, line, (unsigned)(end - line));
+        diagctx_profile_write_path(entries, i, 0, write, userdata);
+        (*write)(userdata, "\n", 1);
+    }
+}
+
+void diagctx_trace_init(diagctx_trace_event* events, unsigned capacity, diagctx_u64 threshold,
+                        diagctx_trace_sink_t* sink, void* userdata)
+{
+    struct diagctx_context* ctx = diagctx_current();
+    assert((events == NULL || (capacity > 0 && sink != NULL)) && "[diagctx] empty trace ring or no sink in diagctx_trace_init()");
+    ctx->trace = events;
+    ctx->trace_capacity = capacity;
+    ctx->trace_next = 0;
+    ctx->trace_full = 0;
+    ctx->trace_keep = 0;
+    ctx->trace_dropped = 0;
+    ctx->trace_start = 0;
+    ctx->trace_threshold = threshold;
+    ctx->trace_sink = sink;
+    ctx->trace_userdata = userdata;
+}
+
+/* Keep the current request, and record the report if 'text' is not NULL. */
+static void diagctx_trace_report(int severity, char const* text) {
+#ifdef DIAGCTX_TRACE
+    struct diagctx_context* ctx = diagctx_current();
+    if (ctx->trace != NULL && ctx->current_id != 0) {
+        if (text != NULL)
+            diagctx_trace_record(ctx, DIAGCTX_TRACE_REPORT, ctx->current_id, (unsigned)severity, text);
+        ctx->trace_keep = 1;
+    }
+#else
+    (void) severity;
+    (void) text;
+#endif
+}
+
+void diagctx_trace_keep(void) {
+    diagctx_trace_report(0, NULL);
+}
+
+void* diagctx_resize(void* buffer, unsigned capacity, diagctx_relocate_t* relocate) {
+    struct diagctx_context* ctx = diagctx_current();
+    char* previous = ctx->buffer;
+    char* next = (char*)buffer;
+    unsigned keep = ctx->stored, i;
+    assert(buffer != NULL && "[diagctx] buffer == NULL in diagctx_resize()");
+    if (ctx->message_size != 0) {
+        unsigned message_size = ctx->message_size;
+        if (keep > capacity)
+            keep = capacity;
+        for (i = ctx->stored; i-- > keep;)
+            if (ctx->msg_destructor != NULL)
+                (*ctx->msg_destructor)(previous + message_size * i);
+        for (i = 0; i < keep; ++i) {
+            if (relocate != NULL)
+                (*relocate)(next + message_size * i, previous + message_size * i, (unsigned)-1);
+            else
+                memcpy(next + message_size * i, previous + message_size * i, message_size);
+        }
+    } else {
+        /* The payloads are stacked from the end of the buffer, so their offsets change. */
+        struct diagctx_header const* headers = DIAGCTX_HEADERS(ctx);
+        struct diagctx_header* moved = (struct diagctx_header*)buffer;
+        unsigned old_end = ctx->capacity / sizeof(union diagctx_align) * sizeof(union diagctx_align);
+        unsigned end = capacity / sizeof(union diagctx_align) * sizeof(union diagctx_align);
+        while (keep > 0 && (sizeof(struct diagctx_header) * keep > end ||
+                            old_end - headers[keep - 1].payload > end - sizeof(struct diagctx_header) * keep))
+            --keep;
+        for (i = ctx->stored; i-- > keep;) {
+            void(*msg_destructor)(void*) = diagctx_types[headers[i].type_id].msg_destructor;
+            if (msg_destructor != NULL)
+                (*msg_destructor)(previous + headers[i].payload);
+        }
+        memcpy(moved, headers, sizeof(struct diagctx_header) * keep);
+        for (i = 0; i < keep; ++i) {
+            struct diagctx_type const* type = &diagctx_types[headers[i].type_id];
+            moved[i].payload = end - (old_end - headers[i].payload);
+            if (relocate != NULL)
+                (*relocate)(next + moved[i].payload, previous + headers[i].payload, headers[i].type_id);
+            else
+                memcpy(next + moved[i].payload, previous + headers[i].payload, type->size);
+            /* The usage sampled at push is not known by 'relocate'. */
+            memcpy(next + moved[i].payload + type->size, previous + headers[i].payload + type->size, type->footprint - type->size);
+        }
+        ctx->top = keep > 0 ? moved[keep - 1].payload : end;
+    }
+    ctx->buffer = next;
+    ctx->capacity = capacity;
+    ctx->stored = keep;
+    return previous;
+}
+
+/* A snapshot starts with this header, followed by an entry per stored message, then the copied messages. */
+struct diagctx_snapshot_header {
+    unsigned count;         /* messages pushed when the snapshot was taken, stored or not */
+    unsigned stored;        /* number of entries */
+};
+
+struct diagctx_snapshot_entry {
+    unsigned type_id;       /* -1 after diagctx_init() */
+    unsigned offset;        /* from the start of the snapshot, 0 if the message was not copied */
+};
+
+#define DIAGCTX_ROUND_UP(size) \
+    ((unsigned)(((size) + sizeof(union diagctx_align) - 1) / sizeof(union diagctx_align) * sizeof(union diagctx_align)))
+
+unsigned diagctx_snapshot(void* snapshot, unsigned capacity) {
+    struct diagctx_context* ctx = diagctx_current();
+    struct diagctx_snapshot_header* header = (struct diagctx_snapshot_header*)snapshot;
+    struct diagctx_snapshot_entry* entries;
+    struct diagctx_header const* headers = DIAGCTX_HEADERS(ctx);
+    unsigned stored = ctx->stored, size, i;
+    size = DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_header)) + DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_entry) * stored);
+    for (i = 0; i < stored; ++i) {
+        if (ctx->message_size != 0)
+            size += ctx->msg_destructor == NULL ? DIAGCTX_ROUND_UP(ctx->message_size) : 0;
+        else if (diagctx_types[headers[i].type_id].msg_destructor == NULL)
+            size += diagctx_types[headers[i].type_id].size;
+    }
+    if (size > capacity)
+        return size;
+
+    header->count = ctx->current_id;
+    header->stored = stored;
+    entries = (struct diagctx_snapshot_entry*)((char*)snapshot + DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_header)));
+    size = DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_header)) + DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_entry) * stored);
+    for (i = 0; i < stored; ++i) {
+        void const* message;
+        unsigned message_size;
+        if (ctx->message_size != 0) {
+            entries[i].type_id = (unsigned)-1;
+            message = ctx->buffer + ctx->message_size * i;
+            message_size = ctx->msg_destructor == NULL ? ctx->message_size : 0;
+        } else {
+            struct diagctx_type const* type = &diagctx_types[headers[i].type_id];
+            entries[i].type_id = headers[i].type_id;
+            message = ctx->buffer + headers[i].payload;
+            message_size = type->msg_destructor == NULL ? type->size : 0;
+        }
+        entries[i].offset = message_size != 0 ? size : 0;
+        memcpy((char*)snapshot + size, message, message_size);
+        size += DIAGCTX_ROUND_UP(message_size);
+    }
+    return size;
+}
+
+void diagctx_snapshot_get(void* snapshot, diagctx_snapshot_handler_t* handler, void* userdata) {
+    struct diagctx_snapshot_header const* header = (struct diagctx_snapshot_header const*)snapshot;
+    struct diagctx_snapshot_entry const* entries =
+        (struct diagctx_snapshot_entry const*)((char*)snapshot + DIAGCTX_ROUND_UP(sizeof(struct diagctx_snapshot_header)));
+    unsigned i;
+    for (i = 0; i < header->count; ++i) {
+        if (i < header->stored)
+            (*handler)(userdata, entries[i].offset != 0 ? (char*)snapshot + entries[i].offset : NULL, entries[i].type_id);
+        else
+            (*handler)(userdata, NULL, (unsigned)-1);
+    }
+}
+
+void diagctx_render_typed(void* userdata, void* message, unsigned type_id) {
+    if (message != NULL && type_id != (unsigned)-1) {
+        diagctx_handler_t* renderer = diagctx_types[type_id].renderer;
+        if (renderer != NULL)
+            (*renderer)(userdata, message);
+    }
+}
+
+diagctx_handle diagctx_handle_of(unsigned msg_id) {
+    struct diagctx_context* ctx = diagctx_current();
+    diagctx_handle handle;
+    assert(ctx->message_size == 0 && "[diagctx] diagctx_handle_of() used without diagctx_init_typed()");
+    assert(msg_id != 0 && msg_id <= ctx->current_id && "[diagctx] incoherent msg_id in diagctx_handle_of()");
+    handle.context = ctx;
+    handle.msg_id = msg_id;
+    handle.generation = msg_id - 1 < ctx->stored ? DIAGCTX_HEADERS(ctx)[msg_id - 1].generation : 0;
+    return handle;
+}
+
+unsigned diagctx_handle_copy(diagctx_handle handle, void* message, unsigned size) {
+    struct diagctx_context* ctx = handle.context;
+    struct diagctx_header const* header;
+    unsigned type_id, payload;
+    if (handle.generation == 0)
+        return (unsigned)-1;
+    /* Headers beyond the stored messages may be overwritten by payloads. */
+    if (handle.msg_id - 1 >= *(unsigned volatile const*)&ctx->stored)
+        return (unsigned)-1;
+    header = DIAGCTX_HEADERS(ctx) + (handle.msg_id - 1);
+    if (DIAGCTX_GENERATION_LOAD(header) != handle.generation)
+        return (unsigned)-1;
+    /* The header is only read after its generation, so it is the one of the message of the handle,
+     * unless the generation changed meanwhile, which is checked after the copy. */
+    type_id = header->type_id;
+    payload = header->payload;
+    if (type_id >= diagctx_type_count || payload > ctx->capacity || ctx->capacity - payload < diagctx_types[type_id].size)
+        return (unsigned)-1;
+    if (size > diagctx_types[type_id].size)
+        size = diagctx_types[type_id].size;
+    memcpy(message, ctx->buffer + payload, size);
+    DIAGCTX_FENCE_ACQUIRE();
+    if (DIAGCTX_GENERATION_LOAD(header) != handle.generation)
+        return (unsigned)-1;
+    return type_id;
+}
+
+void diagctx_set_scratch(void* scratch) {
+    diagctx_current()->scratch = scratch;
+}
+
+unsigned diagctx_context_size(void) {
+    return sizeof(struct diagctx_context);
+}
+
+diagctx_context* diagctx_swap(diagctx_context* context) {
+    struct diagctx_context* previous = diagctx_current();
+    diagctx_installed = context;
+    return previous;
+}
+
+void diagctx_callback_bind(diagctx_callback* callback, void(*fn)(void* arg), void* arg) {
+    callback->fn = fn;
+    callback->arg = arg;
+    callback->context = diagctx_current();
+}
+
+void diagctx_callback_invoke(diagctx_callback const* callback) {
+    struct diagctx_context* previous = diagctx_current();
+    diagctx_installed = callback->context;
+    (*callback->fn)(callback->arg);
+    diagctx_installed = previous;
+}
+
+void diagctx_render(void* userdata, void* message) {
+    if (message != NULL) {
+        diagctx_handler_t* renderer = diagctx_types[diagctx_type_of(message)].renderer;
+        if (renderer != NULL)
+            (*renderer)(userdata, message);
+    }
+}
+
+unsigned diagctx_type_of(void const* message) {
+    struct diagctx_context* ctx = diagctx_current();
+    struct diagctx_header const* headers = DIAGCTX_HEADERS(ctx);
+    unsigned offset = (unsigned)((char const*)message - ctx->buffer);
+    unsigned low = 0, high = ctx->stored;
+    assert(message != NULL && "[diagctx] diagctx_type_of() called for a message which was not stored");
+    /* From the handler of diagctx_get(), the message is usually the one being visited. */
+    if (ctx->visited < high && headers[ctx->visited].payload == offset)
+        return headers[ctx->visited].type_id;
+    /* Otherwise, the payloads are stacked down, so their offsets decrease with the index. */
+    while (high - low > 1) {
+        unsigned middle = low + (high - low) / 2;
+        if (headers[middle].payload < offset)
+            high = middle;
+        else
+            low = middle;
+    }
+    assert(low < high && headers[low].payload == offset && "[diagctx] diagctx_type_of() called for a message of another context");
+    return headers[low].type_id;
+}
+
+char const* diagctx_type_name(unsigned type_id) {
+    assert(type_id < diagctx_type_count && "[diagctx] unregistered type in diagctx_type_name()");
+    return diagctx_types[type_id].name;
+}
+
+unsigned diagctx_type_size(unsigned type_id) {
+    assert(type_id < diagctx_type_count && "[diagctx] unregistered type in diagctx_type_size()");
+    return diagctx_types[type_id].size;
+}
+
+
+
+#ifdef DIAGCTX_SSE2
+static unsigned diagctx_first_bit(unsigned mask) {
+#    ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned) index;
+#    else
+    return (unsigned) __builtin_ctz(mask);
+#    endif
+}
+#endif
+
+/* Copy the printable ASCII bytes at the start of 'in' to 'out', and return how many were copied.
+ * The backslash is not copied, so that it is escaped and escaped texts can be decoded unambiguously.
+ * Both 'in' and 'out' must have 'size' bytes available. Up to a SIMD block of non-printable bytes
+ * may be written after the copied ones, which is harmless because they are within 'out'. */
+static unsigned diagctx_copy_printable(char* out, unsigned char const* in, unsigned size) {
+    unsigned i = 0;
+#ifdef DIAGCTX_AVX2
+    for (; i + 32 <= size; i += 32) {
+        /* signed comparison: bytes >= 0x80 are negative, so below 0x20 too */
+        __m256i v = _mm256_loadu_si256((__m256i const*)(in + i));
+        __m256i bad = _mm256_or_si256(_mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+                                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))),
+                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(bad);
+        _mm256_storeu_si256((__m256i*)(out + i), v);
+        if (mask != 0)
+            return i + diagctx_first_bit(mask);
+    }
+#endif
+#ifdef DIAGCTX_SSE2
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const*)(in + i));
+        __m128i bad = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        unsigned mask = (unsigned) _mm_movemask_epi8(bad);
+        _mm_storeu_si128((__m128i*)(out + i), v);
+        if (mask != 0)
+            return i + diagctx_first_bit(mask);
+    }
+#endif
+#ifdef DIAGCTX_NEON
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t v = vld1q_u8(in + i);
+        uint8x16_t bad = vorrq_u8(vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgeq_u8(v, vdupq_n_u8(0x7F))),
+                                  vceqq_u8(v, vdupq_n_u8('\\')));
+        if (vmaxvq_u8(bad) != 0)
+            break; /* no movemask in NEON, the scalar loop finds the first non-printable byte */
+        vst1q_u8((unsigned char*)(out + i), v);
+    }
+#endif
+    for (; i < size && in[i] >= 0x20 && in[i] < 0x7F && in[i] != '\\'; ++i)
+        out[i] = (char) in[i];
+    return i;
+}
+
+/* Return the length of the valid UTF-8 sequence at the start of 'in', or 0 if it is invalid.
+ * Overlong encodings, surrogates and code points above U+10FFFF are invalid. */
+static unsigned diagctx_utf8_length(unsigned char const* in, unsigned size) {
+    unsigned char c = in[0], lo = 0x80, hi = 0xBF;
+    unsigned length, i;
+    if (c >= 0xC2 && c <= 0xDF)
+        length = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+        length = 3;
+        if (c == 0xE0) lo = 0xA0;
+        else if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        length = 4;
+        if (c == 0xF0) lo = 0x90;
+        else if (c == 0xF4) hi = 0x8F;
+    } else
+        return 0;
+    if (size < length || in[1] < lo || in[1] > hi)
+        return 0;
+    for (i = 2; i < length; ++i)
+        if ((in[i] & 0xC0) != 0x80)
+            return 0;
+    return length;
+}
+
+unsigned diagctx_escape(char* out, unsigned out_size, char const** text, char const* text_end) {
+    static char const hex_digits[] = "0123456789ABCDEF";
+    unsigned char const* in = (unsigned char const*) *text;
+    unsigned in_size = (unsigned) ((unsigned char const*) text_end - in);
+    unsigned i = 0, o = 0;
+    assert(out_size >= 4 && "[diagctx] diagctx_escape() needs room for at least one escaped byte");
+    
+    while (i < in_size) {
+        unsigned length;
+        unsigned available = (in_size - i < out_size - o) ? in_size - i : out_size - o;
+        unsigned copied = diagctx_copy_printable(out + o, in + i, available);
+        i += copied;
+        o += copied;
+        if (i == in_size || o == out_size)
+            break;
+        
+        length = diagctx_utf8_length(in + i, in_size - i);
+        if (length != 0) {
+            if (out_size - o < length)
+                break;
+            memcpy(out + o, in + i, length);
+            i += length;
+            o += length;
+        } else {
+            if (out_size - o < 4)
+                break;
+            out[o++] = '\\';
+            out[o++] = 'x';
+            out[o++] = hex_digits[in[i] >> 4];
+            out[o++] = hex_digits[in[i] & 0xF];
+            ++i;
+        }
+    }
+    *text = (char const*) (in + i);
+    return o;
+}
+
+
+
+static diagctx_report_t* diagctx_report = NULL;
+static void* diagctx_report_userdata = NULL;
+
+void diagctx_set_report(diagctx_report_t* report, void* userdata) {
+    diagctx_report = report;
+    diagctx_report_userdata = userdata;
+}
+
+void diagctx_warn(char const* text, char const* file, int line) {
+    diagctx_trace_report(DIAGCTX_WARNING, text);
+    if (diagctx_report != NULL)
+        (*diagctx_report)(diagctx_report_userdata, DIAGCTX_WARNING, text, file, line);
+}
+
+void diagctx_fail(char const* text, char const* file, int line) {
+    diagctx_trace_report(DIAGCTX_ERROR, text);
+    if (diagctx_report != NULL)
+        (*diagctx_report)(diagctx_report_userdata, DIAGCTX_ERROR, text, file, line);
+    abort();
+}
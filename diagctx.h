@@ -69,6 +69,7 @@ extern "C" {
 
 
 /* Initialize diagctx, must be called before any other function.
+ * It initializes the installed context, which is by default specific to the current thread.
  * diagctx will use a buffer of 'message_size * capacity' bytes.
  * 'msg_destructor' is called when 'msg' is not used anymore. 'msg' will never be NULL.
  *  'msg_destructor' can be NULL if nothing needs to be done.
@@ -91,7 +92,8 @@ void diagctx_init(unsigned message_size,
 
 /* Push a message slot to provide context to a future error.
  * 'msg_id' will store the position of the message, which is needed for the other functions.
- * Returns a pointer to where the message can be put, or NULL if no space is available.
+ * Returns a pointer to where the message can be put, or NULL if no space is available
+ * (see diagctx_set_scratch() to avoid checking for NULL).
  * Example:
  *      unsigned diagmsg_id;
  *      struct MyMessage * diagmsg = diagctx_push(&diagmsg_id);
@@ -131,6 +133,463 @@ typedef void diagctx_handler_t(void* userdata, void* message);
 void diagctx_get(unsigned msg_id, diagctx_handler_t* handler, void* userdata);
 
 
+
+/* Messages of different types can be used instead of a single 'message_size' and 'msg_destructor'.
+ * Each type is registered once with its size, destructor and renderer, and each message
+ * carries its type id. Messages then only use the size of their own type in the buffer,
+ * instead of a slot of the size of the largest message. The library calls the destructor
+ * of each message, and diagctx_render() calls its renderer.
+ * Example in C:
+ *     unsigned line_type = diagctx_register_type("line", sizeof(int), NULL, render_line);
+ *     diagctx_init_typed(malloc(1024), 1024);
+ *     ...
+ *     unsigned msg_id;
+ *     int* line = diagctx_push_typed(line_type, &msg_id);
+ *     if (line != NULL) *line = line_number;
+ *     ... operations ...
+ *     diagctx_pop(msg_id);
+ */
+
+/* Register a message type and return its type id.
+ * 'name' is a static string describing the type, for diagnostics.
+ * 'msg_destructor' is called when a message of this type is not used anymore, it can be NULL.
+ * 'renderer' is called by diagctx_render() for messages of this type, it can be NULL.
+ * Contrary to the messages, types are shared by all threads, so they should be
+ * registered before starting other threads. At most DIAGCTX_MAX_TYPES types can
+ * be registered (64 by default, it can be defined when compiling diagctx.c). */
+unsigned diagctx_register_type(char const* name,
+                               unsigned size,
+                               void(*msg_destructor)(void* msg),
+                               diagctx_handler_t* renderer);
+
+/* Initialize diagctx for typed messages, instead of diagctx_init().
+ * diagctx will use the 'buffer_size' bytes of 'buffer', which must be suitably aligned
+ * for any type (as returned by malloc()). Each message uses a small header, kept in an array
+ * at the start of 'buffer', and the size of its type rounded up to this alignment, from the end. */
+void diagctx_init_typed(void* buffer, unsigned buffer_size);
+
+/* Same as diagctx_push(), for a message of type 'type_id', after diagctx_init_typed().
+ * Returns NULL if no space is available. Deeper messages will not be stored either,
+ * until this message is popped. */
+void* diagctx_push_typed(unsigned type_id, unsigned* msg_id);
+
+/* Call the renderer of the type of 'message' with 'userdata'.
+ * 'message' is a pointer given by diagctx_get() to the handler, after diagctx_init_typed().
+ * Messages which were not stored (NULL) are ignored, so diagctx_render can directly be
+ * given to diagctx_get() as the handler. */
+void diagctx_render(void* userdata, void* message);
+
+/* Return the type id of 'message', a non-NULL pointer given by diagctx_get() after diagctx_init_typed().
+ * 'message' must be stored in the installed context. It costs a few loads for the message given
+ * to the handler of diagctx_get(), and a binary search over the stored messages otherwise.
+ * For the messages of a snapshot, the type is given to the handler, see diagctx_render_typed(). */
+unsigned diagctx_type_of(void const* message);
+
+/* Return the name given to diagctx_register_type() for 'type_id'. */
+char const* diagctx_type_name(unsigned type_id);
+
+/* Return the size used by the messages of 'type_id', the size given to diagctx_register_type() rounded up. */
+unsigned diagctx_type_size(unsigned type_id);
+
+/* Signature of the trigger of a pattern, called by diagctx_push_typed() with the msg_id
+ * of the message making the path match, before the message is written by the caller. */
+typedef void diagctx_trigger_t(void* userdata, unsigned msg_id);
+
+/* Register a pattern over the paths of typed messages, and return its id for diagctx_match().
+ * A pattern is a sequence of type names separated by '>', where '*' matches any number of messages:
+ * "main > for_each_line > count_uppercase_ascii" matches exactly this path,
+ * "* > flush_segment > *" matches the paths going through flush_segment.
+ * The patterns are compiled into an automaton whose state is kept in the header of each message,
+ * so matching costs a few instructions per push. At most 32 patterns can be registered, with at most
+ * 64 states in total, one per pattern and one per segment: beyond, the pattern is not registered
+ * and -1 is returned (assertions fail in debug builds). 'pattern' must stay valid, as the type names.
+ * If 'trigger' is not NULL, it is called with 'userdata' by each push making the path match,
+ * when the path did not match before this push.
+ * Contrary to the messages, patterns are shared by all threads, so they should be registered
+ * before starting other threads and pushing messages. */
+unsigned diagctx_register_pattern(char const* pattern, diagctx_trigger_t* trigger, void* userdata);
+
+/* Return whether the path of the stored messages of the installed context matches the pattern 'pattern_id'. */
+int diagctx_match(unsigned pattern_id);
+
+
+/* Give a slot returned by diagctx_push() and diagctx_push_typed() instead of NULL when no space
+ * is available in the installed context, so that call sites can write messages without checking
+ * for NULL, and the compiler can keep them branch-free.
+ * The slot is overwritten by each push which overflows, and the handler of diagctx_get() still
+ * receives NULL for these messages. It is never destroyed, so messages written unconditionally
+ * must not need 'msg_destructor'. 'scratch' must be suitably aligned and as large as a message
+ * (as the largest type after diagctx_init_typed()). It is reset to NULL by diagctx_init()
+ * and diagctx_init_typed(), to restore the default behavior.
+ * Only the call sites lose their NULL check: there is no inline fast path, as the context is opaque,
+ * so diagctx_push() and diagctx_push_typed() remain calls which test for overflow.
+ * Example in C:
+ *     static struct MyMessage messages[20], scratch;
+ *     diagctx_init(sizeof(struct MyMessage), messages, 20, NULL);
+ *     diagctx_set_scratch(&scratch);
+ *     ...
+ *     unsigned msg_id;
+ *     struct MyMessage* msg = diagctx_push(&msg_id);
+ *     *msg = (struct MyMessage){ ... };
+ */
+void diagctx_set_scratch(void* scratch);
+
+/* Signature of the relocation of a message by diagctx_resize(): 'dst' is initialized from 'src',
+ * and 'src' is then discarded without its destructor. 'type_id' is the type of the message
+ * after diagctx_init_typed(), and -1 after diagctx_init(). */
+typedef void diagctx_relocate_t(void* dst, void* src, unsigned type_id);
+
+/* Move the messages of the installed context to 'buffer', of 'capacity' messages after diagctx_init()
+ * or bytes after diagctx_init_typed(), with the same alignment, and return the previous buffer,
+ * which can then be freed. The stored messages are moved with 'relocate', or memcpy() if it is NULL.
+ * The deepest messages which do not fit in 'buffer' are destroyed, and are then NULL for diagctx_get()
+ * like the messages which were not stored, which stay NULL even if 'buffer' is larger.
+ * 'buffer' must not overlap the previous one, and the pointers returned by the pushes are invalidated.
+ * Example in C:
+ *     free(diagctx_resize(malloc(256 * sizeof(struct MyMessage)), 256, NULL));
+ */
+void* diagctx_resize(void* buffer, unsigned capacity, diagctx_relocate_t* relocate);
+
+/* Copy the messages of the installed context to 'snapshot', of 'capacity' bytes suitably aligned
+ * for any type, so that they can be rendered after they are popped, for instance with an error
+ * returned to the callers. Returns the size needed: if it is larger than 'capacity', nothing is copied.
+ * The messages are copied with memcpy(), and messages with a destructor are not copied (they are then
+ * NULL in the snapshot), as the copy is never destroyed. A snapshot does not depend on its context.
+ * Example in C:
+ *     unsigned size = diagctx_snapshot(NULL, 0);
+ *     void* snapshot = malloc(size);
+ *     diagctx_snapshot(snapshot, size);
+ *     ... pop the messages, return to the callers ...
+ *     diagctx_snapshot_get(snapshot, diagctx_render_typed, stderr);
+ */
+unsigned diagctx_snapshot(void* snapshot, unsigned capacity);
+
+/* Signature of the handler of diagctx_snapshot_get(), like diagctx_handler_t with the type id
+ * of 'message', which is -1 after diagctx_init() and for the typed messages which were not stored. */
+typedef void diagctx_snapshot_handler_t(void* userdata, void* message, unsigned type_id);
+
+/* Call 'handler' for each message of 'snapshot', filled by diagctx_snapshot(), from the first one.
+ * As with diagctx_get(), 'message' is NULL for the messages which were not stored or not copied. */
+void diagctx_snapshot_get(void* snapshot, diagctx_snapshot_handler_t* handler, void* userdata);
+
+/* Call the renderer of 'type_id' for 'message' with 'userdata', if 'message' is not NULL.
+ * It can directly be given to diagctx_snapshot_get() as the handler. */
+void diagctx_render_typed(void* userdata, void* message, unsigned type_id);
+
+
+
+/* The messages are stored in a context, which is by default specific to each thread.
+ * When a thread interleaves several tasks, such as an event loop handling many connections,
+ * each task can have its own context, installed on the thread while the task runs.
+ * Switching contexts only swaps a pointer, and all the functions above use the installed context.
+ * A new context is initialized by installing it, and calling diagctx_init() or diagctx_init_typed().
+ * Example:
+ *     struct Connection { diagctx_context* ctx; MyMessage messages[20]; ... };
+ *     conn->ctx = malloc(diagctx_context_size());
+ *     diagctx_context* previous = diagctx_swap(conn->ctx);
+ *     diagctx_init(sizeof(MyMessage), conn->messages, 20, NULL);
+ *     ... push messages which last as long as the connection ...
+ *     diagctx_swap(previous);
+ */
+typedef struct diagctx_context diagctx_context;
+
+/* Return the size in bytes of a context, to be allocated suitably aligned for any type. */
+unsigned diagctx_context_size(void);
+
+/* Install 'context' on the current thread, and return the previously installed context.
+ * If 'context' is NULL, the default context of the thread is installed. */
+diagctx_context* diagctx_swap(diagctx_context* context);
+
+/* Callback which runs with the context which was installed when it was bound.
+ * This is the building block of event loop adapters: callbacks and timers registered
+ * while handling a task keep the context of this task, whichever task is handled when they run.
+ * Example:
+ *     diagctx_callback on_readable; // stored with the watched file descriptor
+ *     diagctx_callback_bind(&on_readable, read_request, conn);
+ *     ... later, in the event loop ...
+ *     diagctx_callback_invoke(&on_readable);
+ */
+typedef struct {
+    void(*fn)(void* arg);
+    void* arg;
+    diagctx_context* context;
+} diagctx_callback;
+
+/* Bind 'fn' and 'arg' to the currently installed context. */
+void diagctx_callback_bind(diagctx_callback* callback, void(*fn)(void* arg), void* arg);
+
+/* Install the context of 'callback', call it and reinstall the previous context.
+ * If the callback leaves with longjmp() or an exception, diagctx_swap() must be used
+ * by the error handler to reinstall the previous context. */
+void diagctx_callback_invoke(diagctx_callback const* callback);
+
+/* Reference to a typed message, which other threads can copy while it is stored, without locking
+ * the thread which pushed it. Each stored message has a generation, unique in its context, which is
+ * cleared when the message is popped or destroyed by diagctx_get(), so a handle to a popped message
+ * is detected even when its slot is reused by another message. */
+typedef struct {
+    diagctx_context* context;
+    unsigned msg_id;
+    unsigned generation; /* 0 if the message was not stored */
+} diagctx_handle;
+
+/* Return a handle to the message 'msg_id' of the installed context, after diagctx_init_typed().
+ * It is to be called after writing the message, which should then not be modified while it has handles. */
+diagctx_handle diagctx_handle_of(unsigned msg_id);
+
+/* Copy the message of 'handle' to 'message', at most 'size' bytes, and return its type id,
+ * or -1 if the message was not stored or was popped, before or during the copy.
+ * It can be called from any thread, as long as the context exists and is not initialized or resized
+ * meanwhile (the copy is then discarded, like in a seqlock, instead of waiting for the writer).
+ * Example in C:
+ *     diagctx_handle handle = diagctx_handle_of(msg_id); // given to another thread
+ *     ...
+ *     struct Request request; // in the other thread
+ *     if (diagctx_handle_copy(handle, &request, sizeof(request)) == request_type)
+ *         ... the message was still stored, and 'request' is a consistent copy ...
+ */
+unsigned diagctx_handle_copy(diagctx_handle handle, void* message, unsigned size);
+
+
+
+/* Escape the text between '*text' and 'text_end' into 'out' of 'out_size' bytes, for rendering.
+ * Printable ASCII characters and valid UTF-8 sequences are copied, other bytes
+ * (control characters, invalid UTF-8 and the backslash) are written as "\xNN",
+ * so that the original bytes can be decoded from the escaped text.
+ * '*text' is advanced to the first byte which was not escaped, as escaping stops when 'out' is full,
+ * so large texts can be escaped by chunks. 'out_size' must be at least 4.
+ * Returns the number of bytes written to 'out', which is not null-terminated.
+ * Blocks of printable ASCII are copied 16 or 32 bytes at a time with SSE2, AVX2 or NEON when available.
+ * Example:
+ *     char out[256];
+ *     char const* str_end = str + strlen(str);
+ *     while (str != str_end)
+ *         fwrite(out, 1, diagctx_escape(out, sizeof(out), &str, str_end), stderr);
+ */
+unsigned diagctx_escape(char* out, unsigned out_size, char const** text, char const* text_end);
+
+
+
+/* Typed messages can be profiled per context path, which is the sequence of the types of the
+ * stored messages, such as "file;line;token": the time between the push and the pop of each message
+ * and the allocations made while it is the last message are accumulated in a table given by you,
+ * which is specific to a context. Paths are identified by a fingerprint computed from the type names,
+ * so the same path has the same fingerprint in different builds and processes.
+ * diagctx.c must be compiled with DIAGCTX_PROFILE defined, which adds a timestamp
+ * to the header of each typed message. Otherwise, nothing is recorded.
+ * Example in C:
+ *     diagctx_set_profile_clock(my_clock_ns);
+ *     diagctx_init_typed(buffer, sizeof(buffer));
+ *     diagctx_profile_entry entries[256];
+ *     diagctx_profile_init(entries, 256);
+ *     ... push and pop typed messages ...
+ *     diagctx_profile_dump(write_to_file, file);
+ * The dump can be compared with the one of another build with tools/diagctx-diff.cpp. */
+
+/* Unsigned integer of at least 64 bits, for the profiling and tracing counters.
+ * 'long long' is only standard since C99, but it is available as an extension of C89 compilers. */
+#if defined(__GNUC__) && !defined(__cplusplus) && (!defined(__STDC_VERSION__) || __STDC_VERSION__ < 199901L)
+__extension__ typedef unsigned long long diagctx_u64;
+#else
+typedef unsigned long long diagctx_u64;
+#endif
+
+/* Resource usage of the calling thread, measured by the sampler of diagctx_set_profile_usage(). */
+typedef struct {
+    diagctx_u64 cpu_time;              /* CPU time of the thread, usually in nanoseconds */
+    diagctx_u64 minor_faults;          /* page faults without I/O */
+    diagctx_u64 major_faults;          /* page faults with I/O */
+    diagctx_u64 voluntary_switches;    /* context switches while waiting, for I/O or a lock */
+    diagctx_u64 involuntary_switches;  /* context switches by preemption */
+} diagctx_usage;
+
+/* Entry of a profile table, for the path of 'type_id' under the path of the entry 'parent'. */
+typedef struct {
+    diagctx_u64 path;        /* fingerprint of the path, 0 for a free entry */
+    unsigned parent;         /* index of the entry of the parent path, or -1 for the first message */
+    unsigned type_id;        /* type of the last message of the path */
+    diagctx_u64 count;       /* number of messages popped with this path */
+    diagctx_u64 total;       /* clock ticks between push and pop, including nested messages */
+    double total_squares;    /* sum of the squares of the ticks of each message */
+    diagctx_u64 alloc_count; /* allocations reported by diagctx_profile_alloc() */
+    diagctx_u64 alloc_bytes;
+    diagctx_u64 usage_count; /* messages whose resource usage was sampled, see diagctx_profile_usage() */
+    diagctx_usage usage;     /* sum of the differences of usage between push and pop */
+} diagctx_profile_entry;
+
+/* Signature of the clock used for profiling, returning ticks (usually nanoseconds). */
+typedef diagctx_u64 diagctx_clock_t(void);
+
+/* Set the clock used for profiling. Contrary to the messages, the clock is shared by all threads,
+ * so it should be set before starting other threads. If 'clock' is NULL, nothing is recorded. */
+void diagctx_set_profile_clock(diagctx_clock_t* clock);
+
+/* Signature of the sampler of resource usage, such as getrusage(RUSAGE_THREAD) and
+ * clock_gettime(CLOCK_THREAD_CPUTIME_ID) on Linux, which cost about a microsecond. */
+typedef void diagctx_usage_sampler_t(diagctx_usage* usage);
+
+/* Set the sampler of resource usage, shared by all threads like the clock. If 'sampler' is NULL,
+ * the usage is not recorded. It must be set before pushing the messages of the sampled types. */
+void diagctx_set_profile_usage(diagctx_usage_sampler_t* sampler);
+
+/* Sample the resource usage when the messages of 'type_id' are pushed and popped while profiled,
+ * to tell whether a slow path was computing, faulting pages or waiting. As it is slower than the clock,
+ * it is meant for coarse messages. The usage sampled at push is stored after the payload,
+ * so it must be called before pushing messages of 'type_id'. Without DIAGCTX_PROFILE, it does nothing. */
+void diagctx_profile_usage(unsigned type_id);
+
+/* Profile the installed context in 'entries', after diagctx_init_typed() which disables profiling.
+ * 'entries' is cleared, and when its 'capacity' entries are used, new paths are not recorded.
+ * 'entries' may be NULL to stop profiling. Messages destroyed by diagctx_get() after a distant jump
+ * are not counted, as they did not complete. */
+void diagctx_profile_init(diagctx_profile_entry* entries, unsigned capacity);
+
+/* Profile the installed context in 'entries', shared by all the threads which call this function.
+ * 'entries' has 'capacity * shards' entries, zeroed before the first call, which must not be concurrent.
+ * Paths are recorded in the first 'capacity' entries, and the counters are spread over the 'shards'
+ * tables, so threads seldom update the same cache lines. diagctx_profile_dump() merges the shards.
+ * With DIAGCTX_RSEQ on Linux x86-64, a thread updates the table of its CPU with restartable sequences,
+ * and the last table is updated with atomics by the CPUs beyond 'shards - 1': use one shard per CPU, plus one.
+ * Otherwise, or if glibc did not register rseq, each thread updates one of the tables with atomics. */
+void diagctx_profile_init_shared(diagctx_profile_entry* entries, unsigned capacity, unsigned shards);
+
+/* Count an allocation of 'size' bytes for the path of the last stored message, if profiled.
+ * To be called by your allocation functions. Allocations are not counted in the parent paths. */
+void diagctx_profile_alloc(diagctx_u64 size);
+
+/* Signature of the output function of diagctx_profile_dump(). 'text' is not null-terminated. */
+typedef void diagctx_write_t(void* userdata, char const* text, unsigned size);
+
+/* Write the profile of the installed context as text, with a line per path:
+ *     # diagctx profile 2
+ *     <path fingerprint, 16 hex digits> <count> <total> <total_squares> <alloc_count> <alloc_bytes>
+ *         <usage_count> <cpu_time> <minor_faults> <major_faults> <voluntary_switches> <involuntary_switches>
+ *         <type names separated by ';'>
+ * Version 1 had no usage fields.
+ * Dumps of several threads can be concatenated: tools merge the lines of the same fingerprint. */
+void diagctx_profile_dump(diagctx_write_t* write, void* userdata);
+
+
+
+/* A context can record the timeline of each request, from the push of its first message (the root)
+ * until the root is popped, or destroyed by diagctx_get(). The events are written in a ring given by you,
+ * and when the root ends, they are given to a sink only if the request was reported by DIAGCTX_WARN(),
+ * DIAGCTX_FAIL(), DIAGCTX_ASSERT() or diagctx_trace_keep(), or if it lasted at least 'threshold' ticks.
+ * Otherwise the ring is reset, so the full timelines of the few interesting requests are kept
+ * for almost the cost of not tracing. Time is measured with the clock of diagctx_set_profile_clock().
+ * diagctx.c must be compiled with DIAGCTX_TRACE defined. Otherwise, nothing is recorded.
+ * Example in C:
+ *     diagctx_set_profile_clock(my_clock_ns);
+ *     diagctx_trace_event events[1024];
+ *     diagctx_trace_init(events, 1024, 10000000, my_sink, file);  // requests of at least 10 ms
+ *     ... requests push and pop messages ...                      // my_sink() writes their events
+ */
+
+/* Kinds of trace events. */
+#define DIAGCTX_TRACE_PUSH 0    /* after diagctx_push() and diagctx_push_typed() */
+#define DIAGCTX_TRACE_POP 1     /* in diagctx_pop() */
+#define DIAGCTX_TRACE_UNWIND 2  /* diagctx_get() destroyed the messages from 'depth' */
+#define DIAGCTX_TRACE_REPORT 3  /* DIAGCTX_WARN(), DIAGCTX_FAIL() or DIAGCTX_ASSERT() */
+#define DIAGCTX_TRACE_GET 4     /* diagctx_get() gave the messages to a handler */
+
+typedef struct {
+    diagctx_u64 time; /* clock ticks, 0 without clock */
+    unsigned kind;    /* DIAGCTX_TRACE_PUSH, ... */
+    unsigned depth;   /* msg_id of the message, or number of messages for UNWIND, REPORT and GET */
+    unsigned type_id; /* type of the message, -1 if untyped; severity for REPORT */
+    char const* text; /* text of REPORT, NULL otherwise */
+} diagctx_trace_event;
+
+/* Signature of the sink of kept requests. 'events' are the last 'count' events of the request, in order,
+ * and 'dropped' is the number of older events which were overwritten because the ring was full.
+ * 'events' are only valid during the call. */
+typedef void diagctx_trace_sink_t(void* userdata, diagctx_trace_event const* events, unsigned count,
+                                  diagctx_u64 dropped);
+
+/* Trace the requests of the installed context in the ring 'events' of 'capacity' events.
+ * Requests lasting at least 'threshold' ticks are given to 'sink', as well as reported ones.
+ * It should be called when no message is stored, after diagctx_init() or diagctx_init_typed()
+ * which disable tracing. 'events' may be NULL to stop tracing. */
+void diagctx_trace_init(diagctx_trace_event* events, unsigned capacity, diagctx_u64 threshold,
+                        diagctx_trace_sink_t* sink, void* userdata);
+
+/* Keep the current request of the installed context, for instance for an error reported without DIAGCTX_FAIL(). */
+void diagctx_trace_keep(void);
+
+
+
+/* Compiler hints used to keep error reporting out of the hot path. */
+#if defined(__GNUC__)
+#    define DIAGCTX_COLD __attribute__((cold, noinline))
+#    define DIAGCTX_NORETURN __attribute__((noreturn))
+#    define DIAGCTX_UNLIKELY(cond) __builtin_expect(!!(cond), 0)
+#elif defined(_MSC_VER)
+#    define DIAGCTX_COLD __declspec(noinline)
+#    define DIAGCTX_NORETURN __declspec(noreturn)
+#    define DIAGCTX_UNLIKELY(cond) (cond)
+#else
+#    define DIAGCTX_COLD
+#    define DIAGCTX_NORETURN
+#    define DIAGCTX_UNLIKELY(cond) (cond)
+#endif
+
+/* Severities given to the report function. */
+#define DIAGCTX_WARNING 0
+#define DIAGCTX_ERROR 1
+
+/* Signature of the function called by DIAGCTX_WARN(), DIAGCTX_FAIL() and DIAGCTX_ASSERT().
+ * 'severity' is DIAGCTX_WARNING or DIAGCTX_ERROR, 'text' is the text given to the macro
+ * (or the stringified condition for DIAGCTX_ASSERT), 'file' and 'line' locate the macro.
+ * The report function is where the current context is rendered, usually with
+ * diagctx_get(-1, handler, userdata). For DIAGCTX_ERROR, it may longjmp() or throw to
+ * the error handler. If it returns, abort() is called.
+ * Throwing requires diagctx.c to be compiled as C++ (or as C with -fexceptions).
+ *
+ * Example in C:
+ *     void my_report(void* userdata, int severity, char const* text, char const* file, int line) {
+ *         fprintf(stderr, "%s:%d: %s\n", file, line, text);
+ *         diagctx_get(-1, my_handler, NULL);
+ *         if (severity == DIAGCTX_ERROR)
+ *             longjmp(*(jmp_buf*)userdata, 1);
+ *     }
+ */
+typedef void diagctx_report_t(void* userdata, int severity, char const* text, char const* file, int line);
+
+/* Set the report function used by DIAGCTX_WARN(), DIAGCTX_FAIL() and DIAGCTX_ASSERT().
+ * Contrary to the messages, the report function is shared by all threads,
+ * so it should be set before starting other threads. 'report' may be NULL,
+ * in which case warnings are ignored and errors call abort(). */
+void diagctx_set_report(diagctx_report_t* report, void* userdata);
+
+/* Outlined functions behind the macros below. They are marked cold and never inlined,
+ * so that an instrumented function only keeps a compare and a branch on its hot path. */
+DIAGCTX_COLD void diagctx_warn(char const* text, char const* file, int line);
+DIAGCTX_COLD DIAGCTX_NORETURN void diagctx_fail(char const* text, char const* file, int line);
+
+/* Report a warning, execution continues afterwards.
+ * Example:
+ *     if (line_size > 80)
+ *         DIAGCTX_WARN("line too long");
+ */
+#define DIAGCTX_WARN(text) diagctx_warn((text), __FILE__, __LINE__)
+
+/* Report an error, execution does not continue afterwards.
+ * Example:
+ *     if (c >= 128)
+ *         DIAGCTX_FAIL("non-ASCII character");
+ */
+#define DIAGCTX_FAIL(text) diagctx_fail((text), __FILE__, __LINE__)
+
+/* Report an error if 'cond' is false. Contrary to assert(), it is kept with NDEBUG.
+ * Example:
+ *     DIAGCTX_ASSERT(b != 0);
+ */
+#define DIAGCTX_ASSERT(cond) \
+    do { if (DIAGCTX_UNLIKELY(!(cond))) \
+             diagctx_fail("assertion failed: " #cond, __FILE__, __LINE__); \
+    } while (0)
+
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
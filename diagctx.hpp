@@ -0,0 +1,306 @@
+/*
+This is the C++17 header for the diagctx library, written by Julien Vernay ( jvernay.fr ) in 2021.
+It contains optional C++ helpers over the C API of diagctx.h, with their documentation.
+diagctx is a library to log context (= arbitrary data) and retrieve it in case of errors.
+The library is available under the Boost Software License 1.0, whose terms are below:
+
+Boost Software License - Version 1.0 - August 17th, 2003
+
+Permission is hereby granted, free of charge, to any person or organization
+obtaining a copy of the software and accompanying documentation covered by
+this license (the "Software") to use, reproduce, display, distribute,
+execute, and transmit the Software, and to prepare derivative works of the
+Software, and to permit third-parties to whom the Software is furnished to
+do so, all subject to the following:
+
+The copyright notices in the Software and this entire statement, including
+the above license grant, this restriction and the following disclaimer,
+must be included in all copies of the Software, in whole or in part, and
+all derivative works of the Software, unless such copies or derivative
+works are solely in the form of machine-executable object code generated by
+a source language processor.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef JVERNAY_DIAGCTX_HPP
+#define JVERNAY_DIAGCTX_HPP
+
+#include "diagctx.h"
+
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+namespace diagctx {
+
+/* Message formatting its arguments in an inline buffer of N characters, including the final '\0'.
+ * Strings, string_views, characters, integers and floating-point numbers can be appended,
+ * numbers being formatted with std::to_chars. When the buffer is full, the text is truncated
+ * and ends with "...". It never allocates and is trivially destructible, so it can be used
+ * with diagctx_init() without destructor.
+ * Example:
+ *     diagctx::fixed_message<64> msg("line ", 42, ": ", 3.5);
+ *     std::puts(msg.c_str()); // "line 42: 3.5"
+ */
+template<std::size_t N>
+class fixed_message {
+    static_assert(N >= 4, "fixed_message<N> needs room for the truncation marker");
+public:
+    fixed_message() noexcept { m_data[0] = '\0'; }
+
+    template<typename...Args>
+    explicit fixed_message(Args const&...args) noexcept {
+        m_data[0] = '\0';
+        (append(args), ...);
+    }
+
+    fixed_message& append(std::string_view str) noexcept {
+        if (m_truncated)
+            return *this;
+        std::size_t room = N - 1 - m_size;
+        if (str.size() <= room) {
+            std::memcpy(m_data + m_size, str.data(), str.size());
+            m_size += str.size();
+        } else {
+            std::memcpy(m_data + m_size, str.data(), room);
+            std::memcpy(m_data + N - 4, "...", 3);
+            m_size = N - 1;
+            m_truncated = true;
+        }
+        m_data[m_size] = '\0';
+        return *this;
+    }
+
+    fixed_message& append(char const* str) noexcept { return append(std::string_view(str)); }
+    fixed_message& append(char c) noexcept { return append(std::string_view(&c, 1)); }
+    fixed_message& append(bool b) noexcept { return append(b ? "true" : "false"); }
+
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic_v<T>, fixed_message&> append(T value) noexcept {
+        char digits[64]; // enough for any integer and the shortest representation of any floating-point
+        std::to_chars_result res = std::to_chars(digits, digits + sizeof(digits), value);
+        return append(std::string_view(digits, res.ptr - digits));
+    }
+
+    template<typename T>
+    fixed_message& operator<<(T const& value) noexcept { return append(value); }
+
+    char const* c_str() const noexcept { return m_data; }
+    std::string_view view() const noexcept { return std::string_view(m_data, m_size); }
+    std::size_t size() const noexcept { return m_size; }
+    bool truncated() const noexcept { return m_truncated; }
+
+private:
+    std::size_t m_size = 0;
+    bool m_truncated = false;
+    char m_data[N];
+};
+
+/* Push a fixed_message<N> formatted from 'args', and return the id for diagctx_pop().
+ * diagctx must have been initialized with diagctx_init(sizeof(diagctx::fixed_message<N>), ...).
+ * It replaces a message holding a std::ostringstream, without its allocations and locale locks.
+ * Example:
+ *     diagctx::fixed_message<128> messages[20];
+ *     diagctx_init(sizeof(diagctx::fixed_message<128>), messages, 20, nullptr);
+ *     unsigned msg_id = diagctx::push_message<128>("while evaluating '", expr, "'");
+ *     ... operations ...
+ *     diagctx_pop(msg_id);
+ */
+template<std::size_t N, typename...Args>
+unsigned push_message(Args const&...args) noexcept {
+    static_assert(std::is_trivially_destructible_v<fixed_message<N>>);
+    unsigned id;
+    void* msg = diagctx_push(&id);
+    if (msg != nullptr)
+        new (msg) fixed_message<N>(args...);
+    return id;
+}
+
+/* Install 'context' with diagctx_swap() for the lifetime of the guard,
+ * so that the previous context is reinstalled even if an exception is thrown.
+ * Example:
+ *     void on_readable(Connection& conn) {
+ *         diagctx::context_guard guard(conn.ctx);
+ *         ... handle the connection with its own context ...
+ *     }
+ */
+class context_guard {
+public:
+    explicit context_guard(diagctx_context* context) noexcept : m_previous(diagctx_swap(context)) {}
+    ~context_guard() { diagctx_swap(m_previous); }
+
+    context_guard(context_guard const&) = delete;
+    context_guard& operator=(context_guard const&) = delete;
+
+private:
+    diagctx_context* m_previous;
+};
+
+/* Messages of the installed context copied by diagctx_snapshot(), which stay available after they are
+ * popped. The copy is shared by reference counting, so copying 'frames' does not copy the messages.
+ * If the allocation fails, the frames are empty.
+ * Example:
+ *     diagctx::frames context = diagctx::frames::capture();
+ *     ... pop the messages, return to the callers ...
+ *     context.get(diagctx_render_typed, &out);
+ */
+class frames {
+public:
+    frames() noexcept = default;
+    frames(frames const& other) noexcept : m_block(other.m_block) {
+        if (m_block != nullptr)
+            m_block->references.fetch_add(1, std::memory_order_relaxed);
+    }
+    frames(frames&& other) noexcept : m_block(std::exchange(other.m_block, nullptr)) {}
+    frames& operator=(frames other) noexcept {
+        std::swap(m_block, other.m_block);
+        return *this;
+    }
+    ~frames() {
+        if (m_block != nullptr && m_block->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            m_block->~block();
+            ::operator delete(m_block);
+        }
+    }
+
+    static frames capture() noexcept {
+        unsigned size = diagctx_snapshot(nullptr, 0);
+        void* memory = ::operator new(sizeof(block) + size, std::nothrow);
+        frames result;
+        if (memory != nullptr) {
+            result.m_block = new (memory) block;
+            diagctx_snapshot(result.m_block + 1, size);
+        }
+        return result;
+    }
+
+    bool empty() const noexcept { return m_block == nullptr; }
+
+    /* Call 'handler' for each message, see diagctx_snapshot_get(). */
+    void get(diagctx_snapshot_handler_t* handler, void* userdata) const noexcept {
+        if (m_block != nullptr)
+            diagctx_snapshot_get(m_block + 1, handler, userdata);
+    }
+
+    /* Call 'fn(message, type_id)' for each message. */
+    template<typename Fn>
+    void for_each(Fn&& fn) const {
+        using function = std::remove_reference_t<Fn>;
+        get([](void* userdata, void* message, unsigned type_id) { (*static_cast<function*>(userdata))(message, type_id); },
+            const_cast<std::remove_const_t<function>*>(&fn));
+    }
+
+private:
+    struct alignas(std::max_align_t) block {
+        std::atomic<unsigned> references{1};
+    }; // followed by the snapshot
+
+    block* m_block = nullptr;
+};
+
+/* Error of a diagctx::result<T, E>, which captures the frames of the installed context when it is
+ * created, like std::unexpected<E> with the context of the error. Rendering the frames is left to
+ * whoever logs the error, so errors which are handled only cost the copy of the messages.
+ * Example:
+ *     if (!valid)
+ *         return diagctx::unexpected(parse_error::invalid_digit);
+ */
+template<typename E>
+class unexpected {
+public:
+    explicit unexpected(E error) : m_error(std::move(error)), m_frames(frames::capture()) {}
+
+    /* Keep the frames of another error, such as when converting the error of a callee. */
+    unexpected(E error, frames context) : m_error(std::move(error)), m_frames(std::move(context)) {}
+
+    E& error() & noexcept { return m_error; }
+    E const& error() const& noexcept { return m_error; }
+    E&& error() && noexcept { return std::move(m_error); }
+    frames const& context() const noexcept { return m_frames; }
+
+private:
+    E m_error;
+    frames m_frames;
+};
+
+/* Value of type T, or an error of type E with the frames at its creation, in the manner of
+ * std::expected<T, E> (C++23) for code using errors instead of exceptions, where diagctx_get()
+ * cannot be called in a catch-block. The callers forward or handle the error, and only the one
+ * which logs it renders its context, after the messages of the callees were popped.
+ * Example:
+ *     diagctx::result<int, parse_error> parse_digit(char c) {
+ *         if (c < '0' || c > '9')
+ *             return diagctx::unexpected(parse_error::invalid_digit);
+ *         return c - '0';
+ *     }
+ *     ...
+ *     auto digit = parse_digit(c);
+ *     if (!digit)
+ *         digit.context().get(diagctx_render_typed, &out);
+ */
+template<typename T, typename E>
+class result {
+public:
+    result(T value) : m_storage(std::in_place_index<0>, std::move(value)) {}
+    result(unexpected<E> error) : m_storage(std::in_place_index<1>, std::move(error)) {}
+
+    /* Forward the error of a callee with another value type, keeping its frames. */
+    template<typename U>
+    static result forward(result<U, E>&& other) {
+        assert(!other.has_value() && "[diagctx] result::forward() of a value");
+        return result(std::move(other.failure()));
+    }
+
+    bool has_value() const noexcept { return m_storage.index() == 0; }
+    explicit operator bool() const noexcept { return has_value(); }
+
+    T& value() & noexcept {
+        assert(has_value() && "[diagctx] value of a diagctx::result holding an error");
+        return *std::get_if<0>(&m_storage);
+    }
+    T const& value() const& noexcept {
+        assert(has_value() && "[diagctx] value of a diagctx::result holding an error");
+        return *std::get_if<0>(&m_storage);
+    }
+    T&& value() && noexcept { return std::move(value()); }
+    T& operator*() & noexcept { return value(); }
+    T const& operator*() const& noexcept { return value(); }
+    T* operator->() noexcept { return &value(); }
+    T const* operator->() const noexcept { return &value(); }
+
+    template<typename U>
+    T value_or(U&& fallback) const& { return has_value() ? value() : static_cast<T>(std::forward<U>(fallback)); }
+
+    E const& error() const noexcept { return failure().error(); }
+    frames const& context() const noexcept { return failure().context(); }
+
+    unexpected<E>& failure() noexcept {
+        assert(!has_value() && "[diagctx] error of a diagctx::result holding a value");
+        return *std::get_if<1>(&m_storage);
+    }
+    unexpected<E> const& failure() const noexcept {
+        assert(!has_value() && "[diagctx] error of a diagctx::result holding a value");
+        return *std::get_if<1>(&m_storage);
+    }
+
+private:
+    std::variant<T, unexpected<E>> m_storage;
+};
+
+} // namespace diagctx
+
+#endif
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "../diagctx.h"
+
+/* Reference event loop on top of epoll and timerfd (Linux only), where connections are interleaved
+ * on a single thread. Each connection has its own diagctx context, and each callback or timer
+ * runs with the context which was installed when it was registered.
+ * Connections are simulated with pipes. The program checks that each report shows the context
+ * of the connection being handled, and exits with EXIT_FAILURE otherwise. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+
+/************ event loop with context per callback ************/
+
+typedef struct {
+    int fd;
+    diagctx_callback callback;
+} Watcher;
+
+static int epoll_fd;
+static int nb_watchers = 0;
+
+/* 'fn' will run with the context installed now. */
+void watch(Watcher* watcher, int fd, void(*fn)(void*), void* arg) {
+    struct epoll_event event;
+    watcher->fd = fd;
+    diagctx_callback_bind(&watcher->callback, fn, arg);
+    event.events = EPOLLIN;
+    event.data.ptr = watcher;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    ++nb_watchers;
+}
+
+void unwatch(Watcher* watcher) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watcher->fd, NULL);
+    close(watcher->fd);
+    --nb_watchers;
+}
+
+/* 'fn' will run once after 'ms' milliseconds, with the context installed now. */
+void start_timer(Watcher* watcher, long ms, void(*fn)(void*), void* arg) {
+    struct itimerspec spec = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000}};
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    timerfd_settime(fd, 0, &spec, NULL);
+    watch(watcher, fd, fn, arg);
+}
+
+void run_loop(void) {
+    struct epoll_event events[16];
+    while (nb_watchers > 0) {
+        int i, nb_events = epoll_wait(epoll_fd, events, 16, -1);
+        for (i = 0; i < nb_events; ++i)
+            diagctx_callback_invoke(&((Watcher*) events[i].data.ptr)->callback);
+    }
+}
+
+
+/************ types and functions related to diagctx ************/
+
+typedef struct {
+    char str[64];
+} Message;
+
+#define DEBUG_CTX(id_name, ...) \
+    unsigned id_name; \
+    do { Message* msg = (Message*) diagctx_push(&id_name); \
+         if (msg) snprintf(msg->str, sizeof(msg->str), __VA_ARGS__); \
+    } while(0)
+
+typedef struct {
+    char const* name;
+    int fds[2];
+    Watcher readable, idle_timer;
+    diagctx_context* ctx;
+    Message messages[8];
+    unsigned name_msg_id;
+    char pending[256];
+    size_t pending_size;
+} Connection;
+
+Connection* handled_connection = NULL;
+int nb_reports = 0, nb_wrong_reports = 0;
+
+void check_handler(void* first, void* message) {
+    int* is_first = (int*) first;
+    char const* str = message != NULL ? ((Message*) message)->str : "??? (no memory available)";
+    if (*is_first && strcmp(str, handled_connection->name) != 0)
+        ++nb_wrong_reports;
+    *is_first = 0;
+    fprintf(stderr, "  %s\n", str);
+}
+
+void report(void* userdata, int severity, char const* text, char const* file, int line) {
+    int is_first = 1;
+    (void) userdata; (void) file; (void) line;
+    fprintf(stderr, "%s %s\n", severity == DIAGCTX_ERROR ? "ERROR!" : "WARNING!", text);
+    diagctx_get(-1, check_handler, &is_first);
+    ++nb_reports;
+}
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+void on_idle(void* arg) {
+    Connection* conn = (Connection*) arg;
+    handled_connection = conn;
+    DEBUG_CTX(msg_id, "idle timer");
+    DIAGCTX_WARN("connection closed after being idle");
+    diagctx_pop(msg_id);
+    diagctx_pop(conn->name_msg_id);
+    unwatch(&conn->idle_timer);
+    unwatch(&conn->readable);
+    close(conn->fds[1]);
+}
+
+void handle_request(char const* request) {
+    DEBUG_CTX(msg_id, "request '%s'", request);
+    if (strncmp(request, "GET ", 4) != 0)
+        DIAGCTX_WARN("malformed request");
+    diagctx_pop(msg_id);
+}
+
+void on_readable(void* arg) {
+    Connection* conn = (Connection*) arg;
+    char* line;
+    char* newline;
+    ssize_t size;
+    handled_connection = conn;
+    /* small reads, so that requests are split across callbacks */
+    size = read(conn->readable.fd, conn->pending + conn->pending_size, 8);
+    if (size <= 0)
+        return;
+    conn->pending_size += (size_t) size;
+    conn->pending[conn->pending_size] = '\0';
+    line = conn->pending;
+    while ((newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        handle_request(line);
+        line = newline + 1;
+    }
+    conn->pending_size -= (size_t) (line - conn->pending);
+    memmove(conn->pending, line, conn->pending_size);
+    if (conn->idle_timer.fd < 0) /* registered from the callback, so it keeps the connection context */
+        start_timer(&conn->idle_timer, 20, on_idle, conn);
+}
+
+void open_connection(Connection* conn, char const* name) {
+    diagctx_context* previous;
+    Message* msg;
+    conn->name = name;
+    conn->ctx = (diagctx_context*) malloc(diagctx_context_size());
+    conn->pending_size = 0;
+    conn->idle_timer.fd = -1;
+    if (pipe(conn->fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    previous = diagctx_swap(conn->ctx);
+    diagctx_init(sizeof(Message), conn->messages, 8, NULL);
+    msg = (Message*) diagctx_push(&conn->name_msg_id); /* lasts as long as the connection */
+    if (msg)
+        snprintf(msg->str, sizeof(msg->str), "%s", name);
+    watch(&conn->readable, conn->fds[0], on_readable, conn);
+    diagctx_swap(previous);
+}
+
+int main() {
+    Connection a, b;
+    char const* a_requests = "GET /index.html\nGET /style.css\n";
+    char const* b_requests = "GET /api/users\nPOST /api/users\nGET /api/groups\n";
+
+    epoll_fd = epoll_create1(0);
+    diagctx_set_report(report, NULL);
+    open_connection(&a, "connection A");
+    open_connection(&b, "connection B");
+    if (write(a.fds[1], a_requests, strlen(a_requests)) < 0 || write(b.fds[1], b_requests, strlen(b_requests)) < 0) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+
+    run_loop();
+
+    free(a.ctx);
+    free(b.ctx);
+    close(epoll_fd);
+    printf("%d reports, %d with the context of another connection\n", nb_reports, nb_wrong_reports);
+    return nb_reports == 3 && nb_wrong_reports == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,169 @@
+#include "../diagctx.h"
+
+/* Handles to typed messages, copied by another thread while the thread which pushed them goes on.
+ * A reader thread copies the messages of the owner thread while it pushes and pops them, and the
+ * program checks that each copy is either consistent or fails, that a handle taken before a pop
+ * fails, and that a handle does not copy the message which reused its slot.
+ * It exits with EXIT_FAILURE if one of the checks fails.
+ * Build and run:
+ *     gcc -std=gnu99 -pthread diagctx.c examples/handles.c -o diagctx-handles && ./diagctx-handles */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/************ types and functions related to diagctx ************/
+
+unsigned request_type;
+
+int nb_failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        ++nb_failures; \
+    } } while (0)
+
+/* 'check' is computed from the other fields, so a torn copy is detected. */
+typedef struct {
+    unsigned number;
+    unsigned check;
+    char name[24];
+} Request;
+
+unsigned request_check(Request const* request) {
+    unsigned check = request->number * 2654435761u;
+    char const* c;
+    for (c = request->name; *c != '\0'; ++c)
+        check = check * 31 + (unsigned char) *c;
+    return check;
+}
+
+unsigned push_request(unsigned number, char const* prefix) {
+    unsigned msg_id;
+    Request* request = (Request*) diagctx_push_typed(request_type, &msg_id);
+    if (request != NULL) {
+        request->number = number;
+        snprintf(request->name, sizeof(request->name), "%s %u", prefix, number);
+        request->check = request_check(request);
+    }
+    return msg_id;
+}
+
+int is_consistent(Request const* request) {
+    return request->check == request_check(request);
+}
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+#define NB_REQUESTS 200000
+#define NB_COPIES 1000
+
+/* Published by the owner thread: the generation of its latest request, which is always
+ * the second message, with the number of the request, and whether it is done. */
+unsigned long long published_request = 0;
+int done = 0;
+
+typedef struct {
+    diagctx_handle connection;
+    unsigned nb_copies, nb_failed_copies, nb_torn_copies, nb_connection_copies;
+} Reader;
+
+void* reader_thread(void* reader_ptr) {
+    Reader* reader = (Reader*) reader_ptr;
+    Request copy;
+    unsigned long long published;
+    int last;
+    do {
+        diagctx_handle latest = reader->connection;
+        last = __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+        /* the connection is stored during the whole run, so its copies always succeed */
+        if (diagctx_handle_copy(reader->connection, &copy, sizeof(copy)) != request_type
+            || !is_consistent(&copy) || copy.number != 0)
+            ++reader->nb_torn_copies;
+        ++reader->nb_connection_copies;
+        published = __atomic_load_n(&published_request, __ATOMIC_ACQUIRE);
+        latest.msg_id = 2;
+        latest.generation = (unsigned) (published >> 32);
+        memset(&copy, 0, sizeof(copy));
+        if (diagctx_handle_copy(latest, &copy, sizeof(copy)) == request_type) {
+            __atomic_fetch_add(&reader->nb_copies, 1, __ATOMIC_RELAXED);
+            /* a copy of the request which reused the slot would have another number */
+            if (!is_consistent(&copy) || copy.number != (unsigned) published)
+                ++reader->nb_torn_copies;
+        } else {
+            ++reader->nb_failed_copies;
+        }
+    } while (!last);
+    return NULL;
+}
+
+/* A reader thread copies handles while this thread pushes and pops. */
+void copy_while_pushing(void) {
+    Reader reader = {{0, 0, 0}, 0, 0, 0, 0};
+    pthread_t thread;
+    unsigned long long published;
+    unsigned i, connection_id = push_request(0, "connection");
+    reader.connection = diagctx_handle_of(connection_id);
+    pthread_create(&thread, NULL, reader_thread, &reader);
+    /* Until the reader also copied enough requests, even with a single CPU where it only runs
+     * when this thread yields or is preempted, possibly in the middle of a copy. */
+    for (i = 1; i <= NB_REQUESTS || __atomic_load_n(&reader.nb_copies, __ATOMIC_RELAXED) < NB_COPIES; ++i) {
+        unsigned msg_id = push_request(i, "request");
+        published = (unsigned long long) diagctx_handle_of(msg_id).generation << 32 | i;
+        __atomic_store_n(&published_request, published, __ATOMIC_RELEASE);
+        if (i % 1024 == 0)
+            sched_yield();
+        diagctx_pop(msg_id);
+    }
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    diagctx_pop(connection_id);
+    printf("Reader: %u consistent copies, %u failed copies, %u copies of the connection, %u requests\n",
+           reader.nb_copies - reader.nb_torn_copies, reader.nb_failed_copies, reader.nb_connection_copies, i - 1);
+    CHECK(reader.nb_torn_copies == 0);
+    CHECK(reader.nb_connection_copies > 0);
+}
+
+/* A handle taken before a pop fails afterwards. */
+void copy_after_pop(void) {
+    Request copy;
+    unsigned msg_id = push_request(1, "request");
+    diagctx_handle handle = diagctx_handle_of(msg_id);
+    CHECK(diagctx_handle_copy(handle, &copy, sizeof(copy)) == request_type);
+    CHECK(is_consistent(&copy) && copy.number == 1);
+    diagctx_pop(msg_id);
+    CHECK(diagctx_handle_copy(handle, &copy, sizeof(copy)) == (unsigned)-1);
+}
+
+/* A handle does not copy the message which reused the slot of its message. */
+void copy_after_reuse(void) {
+    Request copy;
+    unsigned msg_id = push_request(1, "request");
+    diagctx_handle handle = diagctx_handle_of(msg_id), new_handle;
+    diagctx_pop(msg_id);
+    msg_id = push_request(2, "request");
+    new_handle = diagctx_handle_of(msg_id);
+    CHECK(new_handle.msg_id == handle.msg_id && new_handle.generation != handle.generation);
+    CHECK(diagctx_handle_copy(handle, &copy, sizeof(copy)) == (unsigned)-1);
+    CHECK(diagctx_handle_copy(new_handle, &copy, sizeof(copy)) == request_type);
+    CHECK(is_consistent(&copy) && copy.number == 2);
+    diagctx_pop(msg_id);
+}
+
+int main() {
+    static union { void* p; long double d; char bytes[512]; } buffer;
+    request_type = diagctx_register_type("request", sizeof(Request), NULL, NULL);
+    diagctx_init_typed(&buffer, sizeof(buffer));
+
+    copy_while_pushing();
+    copy_after_pop();
+    copy_after_reuse();
+
+    printf("%d failed checks\n", nb_failures);
+    return nb_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -31,6 +31,14 @@ void destroy_Message(void* msg) {
          } \
     } while(0)
 
+/* Non-printable and non-UTF-8 bytes are written as "\xNN". */
+void fputs_escaped(char const* str, FILE* file) {
+    char out[256];
+    char const* str_end = str + strlen(str);
+    while (str != str_end)
+        fwrite(out, 1, diagctx_escape(out, sizeof(out), &str, str_end), file);
+}
+
 void debug_handler(void* indent_level, void* message) {
     int* indent_lvl = (int*) indent_level;
     int i, imax;
@@ -40,15 +48,25 @@ void debug_handler(void* indent_level, void* message) {
     if (message == NULL)
         fputs("??? (no memory available)", stderr);
     else
-        fputs(((Message*) message)->str, stderr);
+        fputs_escaped(((Message*) message)->str, stderr);
     fputc('\n', stderr);
     ++*indent_lvl;
 }
 
-/******************** ACTUAL PROGRAM *********************/
-
 jmp_buf error_handling_jmp;
 
+/* Called by DIAGCTX_FAIL(), outside of the hot path of the functions below. */
+void report_error(void* userdata, int severity, char const* text, char const* file, int line) {
+    int indent_level = 1;
+    (void) userdata; (void) file; (void) line;
+    fprintf(stderr, "%s %s\n", severity == DIAGCTX_ERROR ? "ERROR!" : "WARNING!", text);
+    diagctx_get(-1, debug_handler, &indent_level);
+    if (severity == DIAGCTX_ERROR)
+        longjmp(error_handling_jmp, 1);
+}
+
+/******************** ACTUAL PROGRAM *********************/
+
 int count_uppercase_ascii(char const* str, int length) {
     int count = 0;
     int i;
@@ -58,8 +76,8 @@ int count_uppercase_ascii(char const* str, int length) {
         if (c >= 128) {
             /* non-ascii detected */
             DEBUG_CTX(msg_id_2, "error: found '\\x%.2X' at position %d", c, i);
-            longjmp(error_handling_jmp, 1);
-            /* diagctx_pop(diagmsg_id_2); not needed because longjmp will exit the scope. */
+            DIAGCTX_FAIL("non-ASCII character");
+            /* diagctx_pop(diagmsg_id_2); not needed because report_error() will longjmp out of the scope. */
         }
         count += (c >= 'A' && c <= 'Z');
     }
@@ -83,10 +101,8 @@ void for_each_line(char const* str) {
             
             diagctx_pop(msg_id_2);
         } else {
-            /* error handling */
-            fputs("ERROR!\n", stderr);
-            int indent_level = 1;
-            diagctx_get(msg_id, debug_handler, &indent_level);
+            /* error handling, the context was already reported by report_error() */
+            diagctx_get(msg_id, NULL, NULL);
         }
         
         str += line_size;
@@ -99,13 +115,14 @@ void for_each_line(char const* str) {
 int main() {
     Message messages_buffer[10];
     diagctx_init(sizeof(Message), messages_buffer, 3, destroy_Message);
+    diagctx_set_report(report_error, NULL);
     
     DEBUG_CTX(msg_id, "main()");
    
     for_each_line("Hello World!\n"
                   "ABC def GHI jlk\n"
                   "Hello \x86 World!\n"
-                  "\x97 test\n"
+                  "\x97 te\\st\n"
                   "\x80\x81\x82\n"
                   "THE END!");
     
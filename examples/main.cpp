@@ -1,37 +1,36 @@
-#include "../diagctx.h"
+#include "../diagctx.hpp"
 
 /* This example will read an ASCII string and returns the number of uppercase letters per line.
  * An error is triggered if a non-ASCII character is found. */
 
 
-#include <sstream>
 #include <string_view>
-#include <iomanip>
 #include <iostream>
 #include <stdexcept>
-#include <type_traits>
 
 using namespace std;
 
 
 /************ types and functions related to diagctx ************/
 
-struct Message {
-    ostringstream out;
-};
+// Formatted in place, without allocation.
+using Message = diagctx::fixed_message<128>;
 
 template<typename...Args>
-unsigned debug_ctx(Args...args) {
-    unsigned id;
-    Message* msg = (Message*) diagctx_push(&id);
-    if (msg != NULL) {
-        new (msg) Message;
-        (msg->out << ... << args);
-    }
-    return id;
+unsigned debug_ctx(Args const&...args) {
+    return diagctx::push_message<128>(args...);
 }
 
 
+// Non-printable and non-UTF-8 bytes are written as "\xNN".
+void cerr_escaped(string_view str) {
+    char out[256];
+    char const* begin = str.data();
+    char const* end = begin + str.size();
+    while (begin != end)
+        std::cerr.write(out, diagctx_escape(out, sizeof(out), &begin, end));
+}
+
 void debug_handler(void* indent_level, void* message) {
     int* indent_lvl = (int*) indent_level;
     int i, imax;
@@ -41,11 +40,19 @@ void debug_handler(void* indent_level, void* message) {
     if (message == NULL)
         std::cerr << "??? (no memory available)";
     else
-        std::cerr << static_cast<Message*>(message)->out.str();
+        cerr_escaped(static_cast<Message*>(message)->view());
     std::cerr << '\n';
     ++*indent_lvl;
 }
 
+// Called by DIAGCTX_FAIL(), outside of the hot path of the functions below.
+void report_error(void*, int severity, char const* text, char const*, int) {
+    cerr << (severity == DIAGCTX_ERROR ? "ERROR! " : "WARNING! ") << text << "\n";
+    int indent_level = 1;
+    diagctx_get(-1, debug_handler, &indent_level);
+    if (severity == DIAGCTX_ERROR)
+        throw std::invalid_argument(text);
+}
 
 
 /******************** ACTUAL PROGRAM *********************/
@@ -59,9 +66,10 @@ int count_uppercase_ascii(string_view str) {
         unsigned char c = str[i];
         if (c >= 128) {
             /* non-ascii detected */
-            unsigned msg_id_2 = debug_ctx("error: found '\\x",  " at position ", i);
-            throw std::invalid_argument("Non-ASCII char");
-            /* diagctx_pop(diagmsg_id_2); not needed because throw will exit the scope. */
+            // The byte is written by diagctx_escape() when rendered, as "\xNN".
+            unsigned msg_id_2 = debug_ctx("error: found '", str.substr(i, 1), "' at position ", i);
+            DIAGCTX_FAIL("Non-ASCII char");
+            /* diagctx_pop(diagmsg_id_2); not needed because report_error() will throw out of the scope. */
         }
         count += (c >= 'A' && c <= 'Z');
     }
@@ -84,11 +92,9 @@ void for_each_line(string_view str) {
             cout << "Line " << line_number << ": " << nb_upper << " upper characters.\n";
             
             diagctx_pop(msg_id_2);
-        } catch (exception const& e) {
-            // error handling
-            cerr << "ERROR! " << e.what() << "\n";
-            int indent_level = 1;
-            diagctx_get(msg_id, debug_handler, &indent_level);
+        } catch (exception const&) {
+            // error handling, the context was already reported by report_error()
+            diagctx_get(msg_id, nullptr, nullptr);
         }
         
         str.remove_prefix(line_size);
@@ -100,17 +106,18 @@ void for_each_line(string_view str) {
 
 
 int main() {
-    std::aligned_union<0, Message[10]> messages_buffer;
+    Message messages_buffer[10];
 
-    diagctx_init(sizeof(Message), &messages_buffer, 10,
-        [] (void* msg) { static_cast<Message*>(msg)->~Message(); });
+    // Message is trivially destructible, so no destructor is needed.
+    diagctx_init(sizeof(Message), messages_buffer, 10, nullptr);
+    diagctx_set_report(report_error, nullptr);
     
     unsigned msg_id = debug_ctx("main()");
     
     for_each_line("Hello World!\n"
                   "ABC def GHI jlk\n"
                   "Hello \x86 World!\n"
-                  "\x97 test\n"
+                  "\x97 te\\st\n"
                   "\x80\x81\x82\n"
                   "THE END!");
     
@@ -0,0 +1,148 @@
+#include "../diagctx.h"
+
+/* Patterns over the paths of typed messages, matched incrementally by each push.
+ * The functions push a message of their own type, and the program checks diagctx_match()
+ * and the triggers of two patterns along real pushes and pops, exiting with EXIT_FAILURE
+ * if one of them disagrees with the path.
+ * Build and run:
+ *     gcc -std=c99 diagctx.c examples/patterns.c -o diagctx-patterns && ./diagctx-patterns */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/************ types and functions related to diagctx ************/
+
+unsigned main_type, for_each_line_type, count_type, write_file_type, flush_type, write_block_type;
+unsigned exact_pattern, flush_pattern;
+
+int nb_failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        ++nb_failures; \
+    } } while (0)
+
+void render_text(void* userdata, void* message) {
+    (void) userdata;
+    fputs(*(char const**) message, stderr);
+}
+
+unsigned push(unsigned type_id, char const* text) {
+    unsigned msg_id;
+    char const** msg = (char const**) diagctx_push_typed(type_id, &msg_id);
+    if (msg != NULL)
+        *msg = text;
+    return msg_id;
+}
+
+/* Triggers record the message which made the path match. */
+typedef struct {
+    int count;
+    unsigned msg_id;
+} Triggered;
+
+Triggered exact_triggered, flush_triggered;
+
+void on_match(void* userdata, unsigned msg_id) {
+    Triggered* triggered = (Triggered*) userdata;
+    ++triggered->count;
+    triggered->msg_id = msg_id;
+}
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+/* 'exact' tells whether the path is "main > for_each_line > count_uppercase_ascii". */
+int count_uppercase_ascii(char const* str, int exact) {
+    int count = 0;
+    int triggers = exact_triggered.count;
+    unsigned msg_id = push(count_type, "count_uppercase_ascii()");
+    CHECK(diagctx_match(exact_pattern) == exact);
+    CHECK(exact_triggered.count == triggers + exact);
+    if (exact)
+        CHECK(exact_triggered.msg_id == msg_id);
+    for (; *str != '\0'; ++str)
+        count += (*str >= 'A' && *str <= 'Z');
+    diagctx_pop(msg_id);
+    return count;
+}
+
+void for_each_line(char const* const* lines, int nb_lines) {
+    unsigned msg_id = push(for_each_line_type, "for_each_line()");
+    int i;
+    CHECK(!diagctx_match(exact_pattern));
+    for (i = 0; i < nb_lines; ++i) {
+        printf("Line %d: %d upper characters\n", i + 1, count_uppercase_ascii(lines[i], 1));
+        /* the pop gives back the state of the path without the message */
+        CHECK(!diagctx_match(exact_pattern));
+    }
+    diagctx_pop(msg_id);
+}
+
+void write_block(void) {
+    int triggers = flush_triggered.count;
+    unsigned msg_id = push(write_block_type, "write_block()");
+    CHECK(diagctx_match(flush_pattern)); /* the trailing '*' matches any message */
+    CHECK(flush_triggered.count == triggers); /* the path already matched */
+    diagctx_pop(msg_id);
+}
+
+void flush_segment(char const* segment) {
+    int triggers = flush_triggered.count;
+    unsigned msg_id = push(flush_type, "flush_segment()");
+    CHECK(diagctx_match(flush_pattern));
+    CHECK(flush_triggered.count == triggers + 1 && flush_triggered.msg_id == msg_id);
+    write_block();
+    /* same type as in for_each_line(), but on another path */
+    printf("Segment: %d upper characters\n", count_uppercase_ascii(segment, 0));
+    CHECK(diagctx_match(flush_pattern));
+    diagctx_pop(msg_id);
+    CHECK(!diagctx_match(flush_pattern));
+}
+
+void write_file(char const* const* segments, int nb_segments) {
+    unsigned msg_id = push(write_file_type, "write_file()");
+    int i;
+    CHECK(!diagctx_match(flush_pattern));
+    for (i = 0; i < nb_segments; ++i)
+        flush_segment(segments[i]); /* each flush enters the pattern again */
+    diagctx_pop(msg_id);
+}
+
+int main() {
+    static union { void* p; long double d; char bytes[512]; } buffer;
+    char const* lines[] = {"Hello World!", "ABC def GHI jkl"};
+    char const* segments[] = {"HEADER", "body", "FOOTER"};
+    unsigned msg_id;
+
+    /* Types registered before and after the patterns get the same states. */
+    main_type = diagctx_register_type("main", sizeof(char const*), NULL, render_text);
+    for_each_line_type = diagctx_register_type("for_each_line", sizeof(char const*), NULL, render_text);
+    count_type = diagctx_register_type("count_uppercase_ascii", sizeof(char const*), NULL, render_text);
+    exact_pattern = diagctx_register_pattern("main > for_each_line > count_uppercase_ascii",
+                                             on_match, &exact_triggered);
+    flush_pattern = diagctx_register_pattern("* > flush_segment > *", on_match, &flush_triggered);
+    write_file_type = diagctx_register_type("write_file", sizeof(char const*), NULL, render_text);
+    flush_type = diagctx_register_type("flush_segment", sizeof(char const*), NULL, render_text);
+    write_block_type = diagctx_register_type("write_block", sizeof(char const*), NULL, render_text);
+    diagctx_init_typed(&buffer, sizeof(buffer));
+
+    CHECK(!diagctx_match(exact_pattern) && !diagctx_match(flush_pattern));
+    msg_id = push(main_type, "main()");
+    for_each_line(lines, 2);
+    write_file(segments, 3);
+    diagctx_pop(msg_id);
+
+    /* Without "main" first, the exact pattern does not match. */
+    msg_id = push(for_each_line_type, "for_each_line()");
+    count_uppercase_ascii("NOT MATCHED", 0);
+    diagctx_pop(msg_id);
+    /* The leading '*' matches no message. */
+    flush_segment("FIRST");
+
+    printf("%d and %d triggers, %d failed checks\n", exact_triggered.count, flush_triggered.count, nb_failures);
+    CHECK(exact_triggered.count == 2 && flush_triggered.count == 4);
+    return nb_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE /* clock_gettime(), and RUSAGE_THREAD on Linux */
+#include "../diagctx.h"
+
+/* Profiling per context path, with an importer of CSV-like records ("import;record;field").
+ * Must be compiled with DIAGCTX_PROFILE:
+ *     gcc -DDIAGCTX_PROFILE diagctx.c examples/profile.c -o profile
+ *     ./profile > before.txt
+ *     ./profile --slower-fields > after.txt
+ *     g++ -std=c++17 tools/diagctx-diff.cpp -o diagctx-diff && ./diagctx-diff before.txt after.txt
+ * '--slower-fields' simulates a regression of parse_field(), in time and allocations.
+ * The resource usage is sampled for each import, which is coarse enough. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+
+/************ types and functions related to diagctx ************/
+
+unsigned long long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+void sample_usage(diagctx_usage* usage) {
+    struct timespec ts;
+    struct rusage ru;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+#else
+    getrusage(RUSAGE_SELF, &ru); /* the process, which has a single thread here */
+#endif
+    usage->cpu_time = (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+    usage->minor_faults = (unsigned long long) ru.ru_minflt;
+    usage->major_faults = (unsigned long long) ru.ru_majflt;
+    usage->voluntary_switches = (unsigned long long) ru.ru_nvcsw;
+    usage->involuntary_switches = (unsigned long long) ru.ru_nivcsw;
+}
+
+/* Allocations are counted for the path of the last message. */
+void* profiled_malloc(size_t size) {
+    diagctx_profile_alloc(size);
+    return malloc(size);
+}
+
+void write_to_file(void* file, char const* text, unsigned size) {
+    fwrite(text, 1, size, (FILE*) file);
+}
+
+unsigned import_type, record_type, field_type;
+
+#define PUSH(id_name, type, value) \
+    unsigned id_name; \
+    do { int* msg = (int*) diagctx_push_typed(type, &id_name); \
+         if (msg) *msg = (value); \
+    } while(0)
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+int slower_fields = 0;
+
+unsigned long parse_field(char const* str, int length, int index) {
+    char* copy;
+    unsigned long value = 0;
+    int i, repeat;
+    PUSH(msg_id, field_type, index);
+    copy = (char*) profiled_malloc(slower_fields ? 64 + (size_t) length : (size_t) length + 1);
+    memcpy(copy, str, (size_t) length);
+    for (repeat = 0; repeat < (slower_fields ? 3 : 2); ++repeat)
+        for (i = 0; i < length; ++i)
+            value = value * 31 + copy[i];
+    free(copy);
+    diagctx_pop(msg_id);
+    return value;
+}
+
+unsigned long parse_record(char const* line, int line_number) {
+    unsigned long sum = 0;
+    int index = 0;
+    char const* field = line;
+    PUSH(msg_id, record_type, line_number);
+    for (;;) {
+        char const* end = strchr(field, ',');
+        int length = end != NULL ? (int) (end - field) : (int) strlen(field);
+        sum += parse_field(field, length, index++);
+        if (end == NULL)
+            break;
+        field = end + 1;
+    }
+    diagctx_pop(msg_id);
+    return sum;
+}
+
+unsigned long import_records(int file_number, int nb_records) {
+    unsigned long sum = 0;
+    int i;
+    char line[128];
+    PUSH(msg_id, import_type, file_number);
+    for (i = 0; i < nb_records; ++i) {
+        sprintf(line, "%d,item-%d,%d.%02d,warehouse %d", i, i * 7, i % 1000, i % 100, i % 13);
+        sum += parse_record(line, i + 1);
+    }
+    diagctx_pop(msg_id);
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    static union { long double alignment; char bytes[1024]; } buffer;
+    static diagctx_profile_entry entries[64];
+    unsigned long sum = 0;
+    int file_number;
+    slower_fields = argc > 1 && strcmp(argv[1], "--slower-fields") == 0;
+
+    import_type = diagctx_register_type("import", sizeof(int), NULL, NULL);
+    record_type = diagctx_register_type("record", sizeof(int), NULL, NULL);
+    field_type = diagctx_register_type("field", sizeof(int), NULL, NULL);
+    diagctx_profile_usage(import_type);
+    diagctx_set_profile_clock(clock_ns);
+    diagctx_set_profile_usage(sample_usage);
+    diagctx_init_typed(&buffer, sizeof(buffer));
+    diagctx_profile_init(entries, 64);
+
+    for (file_number = 0; file_number < 20; ++file_number)
+        sum += import_records(file_number, 2000);
+
+    diagctx_profile_dump(write_to_file, stdout);
+    fprintf(stderr, "checksum %lu\n", sum);
+    return EXIT_SUCCESS;
+}
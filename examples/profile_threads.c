@@ -0,0 +1,143 @@
+#define _GNU_SOURCE /* clock_gettime() */
+#include "../diagctx.h"
+
+/* Profile table shared by threads, whose counters are split in shards merged by diagctx_profile_dump().
+ * Each thread imports records with its own context, as in profile.c, and the program checks that
+ * the merged counts of each path are the number of threads times the messages of a thread,
+ * exiting with EXIT_FAILURE otherwise. Must be compiled with DIAGCTX_PROFILE, and DIAGCTX_RSEQ
+ * to update the shard of the CPU with restartable sequences (Linux on x86-64), and C11 or later
+ * for the default contexts to be thread-local:
+ *     gcc -std=c11 -pthread -DDIAGCTX_PROFILE -DDIAGCTX_RSEQ diagctx.c examples/profile_threads.c -o profile_threads
+ *     ./profile_threads */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/************ types and functions related to diagctx ************/
+
+unsigned long long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+/* The dump is written in memory, to be checked. */
+typedef struct {
+    char text[4096];
+    unsigned size;
+} Dump;
+
+void write_to_dump(void* dump_ptr, char const* text, unsigned size) {
+    Dump* dump = (Dump*) dump_ptr;
+    if (size > sizeof(dump->text) - 1 - dump->size)
+        size = (unsigned) (sizeof(dump->text) - 1 - dump->size);
+    memcpy(dump->text + dump->size, text, size);
+    dump->size += size;
+    dump->text[dump->size] = '\0';
+}
+
+/* Count of 'path' in the dump, or 0 if it is not there. */
+unsigned long long dumped_count(Dump const* dump, char const* path) {
+    char const* line = dump->text;
+    while ((line = strchr(line, '\n')) != NULL) {
+        char fingerprint[17], dumped_path[64];
+        unsigned long long count;
+        ++line;
+        /* <fingerprint> <count> ... <path>, with 10 other counters in between */
+        if (sscanf(line, "%16s %llu %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %63s", fingerprint, &count, dumped_path) == 3
+            && strcmp(dumped_path, path) == 0)
+            return count;
+    }
+    return 0;
+}
+
+unsigned import_type, record_type, field_type;
+diagctx_profile_entry* entries;
+unsigned nb_shards;
+
+#define PUSH(id_name, type, value) \
+    unsigned id_name; \
+    do { int* msg = (int*) diagctx_push_typed(type, &id_name); \
+         if (msg) *msg = (value); \
+    } while(0)
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+#define NB_THREADS 8
+#define NB_FILES 20
+#define NB_RECORDS 500
+#define NB_FIELDS 4
+
+unsigned long parse_record(int line_number) {
+    unsigned long sum = 0;
+    int index;
+    PUSH(msg_id, record_type, line_number);
+    for (index = 0; index < NB_FIELDS; ++index) {
+        PUSH(field_id, field_type, index);
+        diagctx_profile_alloc(16);
+        sum += (unsigned long) (line_number * 31 + index);
+        diagctx_pop(field_id);
+    }
+    diagctx_pop(msg_id);
+    return sum;
+}
+
+void* import_thread(void* sum_ptr) {
+    static union { long double alignment; char bytes[1024]; } buffers[NB_THREADS];
+    static int nb_started = 0;
+    unsigned long* sum = (unsigned long*) sum_ptr;
+    int file_number, i;
+    /* Each thread has its default context, profiled in the shared table. */
+    diagctx_init_typed(&buffers[__atomic_fetch_add(&nb_started, 1, __ATOMIC_RELAXED)], sizeof(buffers[0]));
+    diagctx_profile_init_shared(entries, 16, nb_shards);
+    for (file_number = 0; file_number < NB_FILES; ++file_number) {
+        PUSH(msg_id, import_type, file_number);
+        for (i = 0; i < NB_RECORDS; ++i)
+            *sum += parse_record(i + 1);
+        diagctx_pop(msg_id);
+    }
+    return NULL;
+}
+
+int main() {
+    static union { long double alignment; char bytes[256]; } buffer;
+    static Dump dump;
+    pthread_t threads[NB_THREADS];
+    unsigned long sums[NB_THREADS] = {0};
+    unsigned long sum = 0;
+    int i, ok;
+
+    import_type = diagctx_register_type("import", sizeof(int), NULL, NULL);
+    record_type = diagctx_register_type("record", sizeof(int), NULL, NULL);
+    field_type = diagctx_register_type("field", sizeof(int), NULL, NULL);
+    diagctx_set_profile_clock(clock_ns);
+
+    /* One shard per CPU, plus one for the threads updating it with atomics. */
+    nb_shards = (unsigned) sysconf(_SC_NPROCESSORS_CONF) + 1;
+    entries = (diagctx_profile_entry*) calloc(16 * nb_shards, sizeof(diagctx_profile_entry));
+    diagctx_init_typed(&buffer, sizeof(buffer));
+    diagctx_profile_init_shared(entries, 16, nb_shards); /* the first call, before the threads */
+
+    for (i = 0; i < NB_THREADS; ++i)
+        pthread_create(&threads[i], NULL, import_thread, &sums[i]);
+    for (i = 0; i < NB_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        sum += sums[i];
+    }
+
+    diagctx_profile_dump(write_to_dump, &dump);
+    fputs(dump.text, stdout);
+    ok = dumped_count(&dump, "import") == NB_THREADS * NB_FILES
+      && dumped_count(&dump, "import;record") == NB_THREADS * NB_FILES * NB_RECORDS
+      && dumped_count(&dump, "import;record;field") == NB_THREADS * NB_FILES * NB_RECORDS * NB_FIELDS;
+    fprintf(stderr, "checksum %lu\n", sum);
+    printf("%u shards, counts %s\n", nb_shards, ok ? "merged exactly" : "WRONG");
+    free(entries);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
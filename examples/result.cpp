@@ -0,0 +1,130 @@
+#include "../diagctx.hpp"
+
+// Errors returned with diagctx::result<T, E> instead of thrown: each error captures the frames
+// of the context when it is created, and only the errors which are logged render them,
+// after the callees returned and popped their messages.
+// Build and run:
+//     g++ -std=c++17 diagctx.c examples/result.cpp -o result && ./result
+
+#include <cstdio>
+#include <string_view>
+
+
+/************ types and functions related to diagctx ************/
+
+void render_text(void*, void* message) {
+    std::fputs(*static_cast<char const**>(message), stderr);
+}
+
+void render_line(void*, void* message) {
+    std::fprintf(stderr, "line %d", *static_cast<int*>(message));
+}
+
+void render_field(void*, void* message) {
+    std::string_view field = *static_cast<std::string_view*>(message);
+    std::fprintf(stderr, "field '%.*s'", static_cast<int>(field.size()), field.data());
+}
+
+unsigned text_type, line_type, field_type;
+
+// Pushes a message for the lifetime of the frame.
+class frame {
+public:
+    template<typename T>
+    frame(unsigned type_id, T value) noexcept {
+        void* msg = diagctx_push_typed(type_id, &m_id);
+        if (msg != nullptr)
+            new (msg) T(value);
+    }
+    ~frame() { diagctx_pop(m_id); }
+
+    frame(frame const&) = delete;
+    frame& operator=(frame const&) = delete;
+
+private:
+    unsigned m_id;
+};
+
+void log_error(char const* error, diagctx::frames const& context) {
+    int depth = 0;
+    context.for_each([&depth](void* message, unsigned type_id) {
+        std::fprintf(stderr, "%*s", 2 * depth++, "");
+        if (message != nullptr)
+            diagctx_render_typed(nullptr, message, type_id);
+        else
+            std::fputs("???", stderr);
+        std::fputs(":\n", stderr);
+    });
+    std::fprintf(stderr, "%*serror: %s\n", 2 * depth, "", error);
+}
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+enum class parse_error { empty, invalid_digit, too_large };
+
+char const* to_string(parse_error error) {
+    switch (error) {
+    case parse_error::empty: return "empty number";
+    case parse_error::invalid_digit: return "invalid digit";
+    case parse_error::too_large: return "number too large";
+    }
+    return "?";
+}
+
+diagctx::result<int, parse_error> parse_number(std::string_view field) {
+    frame f(field_type, field);
+    if (field.empty())
+        return diagctx::unexpected(parse_error::empty);
+    int value = 0;
+    for (char c : field) {
+        if (c < '0' || c > '9')
+            return diagctx::unexpected(parse_error::invalid_digit);
+        if (value > 100000)
+            return diagctx::unexpected(parse_error::too_large);
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+// Sums the numbers of a line "a,b,c". The error of a field is forwarded with its frames.
+diagctx::result<long, parse_error> sum_line(std::string_view line, int line_number) {
+    frame f(line_type, line_number);
+    long sum = 0;
+    for (;;) {
+        std::size_t comma = line.find(',');
+        auto number = parse_number(line.substr(0, comma));
+        if (!number)
+            return diagctx::result<long, parse_error>::forward(std::move(number));
+        sum += *number;
+        if (comma == std::string_view::npos)
+            return sum;
+        line.remove_prefix(comma + 1);
+    }
+}
+
+int main() {
+    alignas(std::max_align_t) static char buffer[1024];
+    text_type = diagctx_register_type("text", sizeof(char const*), nullptr, render_text);
+    line_type = diagctx_register_type("line", sizeof(int), nullptr, render_line);
+    field_type = diagctx_register_type("field", sizeof(std::string_view), nullptr, render_field);
+    diagctx_init_typed(buffer, sizeof(buffer));
+
+    char const* const lines[] = {"1,2,3", "4,,6", "7,8x,9", "10,11,12", "13,99999999"};
+    frame f(text_type, "while summing the lines of 'numbers.csv'");
+    long total = 0;
+    for (int i = 0; i < 5; ++i) {
+        auto sum = sum_line(lines[i], i + 1);
+        if (!sum && sum.error() == parse_error::empty) {
+            // Handled: the frames were copied, but are never rendered.
+            continue;
+        }
+        if (!sum) {
+            log_error(to_string(sum.error()), sum.context());
+            continue;
+        }
+        total += *sum;
+    }
+    std::printf("total: %ld\n", total);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 199309L
+#include "../diagctx.h"
+
+/* Tail-based tracing of requests: the events of every request are recorded, and the timelines
+ * are only written for the requests which failed or lasted at least 1 ms.
+ * Must be compiled with DIAGCTX_TRACE:
+ *     gcc -DDIAGCTX_TRACE diagctx.c examples/trace.c -o trace && ./trace */
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+/************ types and functions related to diagctx ************/
+
+unsigned long long clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+void write_timeline(void* userdata, diagctx_trace_event const* events, unsigned count, unsigned long long dropped) {
+    static char const* const kinds[] = {"push", "pop", "unwind", "report", "get"};
+    unsigned i;
+    (void) userdata;
+    printf("request kept, %u events (%llu dropped):\n", count, dropped);
+    for (i = 0; i < count; ++i) {
+        diagctx_trace_event const* event = &events[i];
+        printf("  %+9.3f us  %*s%-6s", (double) (event->time - events[0].time) / 1000.0, (int) event->depth * 2, "",
+               kinds[event->kind]);
+        if (event->kind == DIAGCTX_TRACE_REPORT)
+            printf(" %s", event->text);
+        else if (event->type_id != (unsigned) -1)
+            printf(" %s", diagctx_type_name(event->type_id));
+        printf("\n");
+    }
+}
+
+jmp_buf request_error;
+
+void report_error(void* userdata, int severity, char const* text, char const* file, int line) {
+    (void) userdata;
+    (void) text;
+    (void) file;
+    (void) line;
+    if (severity == DIAGCTX_ERROR)
+        longjmp(request_error, 1);
+}
+
+unsigned request_type, query_type, row_type;
+
+#define PUSH(id_name, type, value) \
+    unsigned id_name; \
+    do { int* msg = (int*) diagctx_push_typed(type, &id_name); \
+         if (msg) *msg = (value); \
+    } while(0)
+
+
+/******************** ACTUAL PROGRAM *********************/
+
+unsigned long read_row(int row) {
+    unsigned long value = (unsigned long) row * 2654435761UL;
+    PUSH(msg_id, row_type, row);
+    if (value % 7919 == 0)
+        DIAGCTX_FAIL("corrupted row");
+    diagctx_pop(msg_id);
+    return value;
+}
+
+unsigned long run_query(int request, int query) {
+    unsigned long sum = 0;
+    int row;
+    PUSH(msg_id, query_type, query);
+    for (row = 0; row < 4; ++row)
+        sum += read_row(request * 16 + query * 4 + row);
+    if (request % 3001 == 1000) { /* a slow query */
+        unsigned long long start = clock_ns();
+        while (clock_ns() - start < 2000000)
+            ++sum;
+    }
+    diagctx_pop(msg_id);
+    return sum;
+}
+
+unsigned long handle_request(int request) {
+    unsigned long sum = 0;
+    int query;
+    PUSH(msg_id, request_type, request);
+    for (query = 0; query < 4; ++query)
+        sum += run_query(request, query);
+    diagctx_pop(msg_id);
+    return sum;
+}
+
+int main(void) {
+    static union { long double alignment; char bytes[1024]; } buffer;
+    static diagctx_trace_event events[64];
+    volatile unsigned long sum = 0; /* modified after setjmp() */
+    volatile int failed = 0;
+    int request;
+
+    request_type = diagctx_register_type("request", sizeof(int), NULL, NULL);
+    query_type = diagctx_register_type("query", sizeof(int), NULL, NULL);
+    row_type = diagctx_register_type("row", sizeof(int), NULL, NULL);
+    diagctx_set_profile_clock(clock_ns);
+    diagctx_set_report(report_error, NULL);
+    diagctx_init_typed(&buffer, sizeof(buffer));
+    diagctx_trace_init(events, 64, 1000000, write_timeline, NULL);
+
+    for (request = 0; request < 10000; ++request) {
+        if (setjmp(request_error) == 0) {
+            sum += handle_request(request);
+        } else {
+            diagctx_get(0, NULL, NULL); /* destroys the messages of the request, which ends it */
+            ++failed;
+        }
+    }
+    fprintf(stderr, "%d requests failed, checksum %lu\n", failed, sum);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,244 @@
+#include "../diagctx.h"
+
+/* Same program as main.c, but using messages of different types.
+ * Each message only uses the size of its own type in the buffer,
+ * and the library calls the right renderer for each message.
+ * Then, the messages are moved to a larger buffer and to a smaller one with diagctx_resize(),
+ * and the program exits with EXIT_FAILURE if the messages are not the expected ones. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <string.h>
+
+
+/************ types and functions related to diagctx ************/
+
+typedef struct {
+    char const* str;
+    int length;
+} Span;
+
+typedef struct {
+    unsigned char c;
+    int position;
+} BadChar;
+
+/* Non-printable and non-UTF-8 bytes are written as "\xNN". */
+void fwrite_escaped(char const* str, int length, FILE* file) {
+    char out[256];
+    char const* str_end = str + length;
+    while (str != str_end)
+        fwrite(out, 1, diagctx_escape(out, sizeof(out), &str, str_end), file);
+}
+
+void render_text(void* userdata, void* message) {
+    (void) userdata;
+    fputs(*(char const**) message, stderr);
+}
+
+void render_line(void* userdata, void* message) {
+    (void) userdata;
+    fprintf(stderr, "line %d", *(int*) message);
+}
+
+void render_span(void* userdata, void* message) {
+    Span* span = (Span*) message;
+    (void) userdata;
+    fputs("count_uppercase_ascii(\"", stderr);
+    fwrite_escaped(span->str, span->length, stderr);
+    fprintf(stderr, "\", %i)", span->length);
+}
+
+void render_bad_char(void* userdata, void* message) {
+    BadChar* bad = (BadChar*) message;
+    (void) userdata;
+    fprintf(stderr, "error: found '\\x%.2X' at position %d", bad->c, bad->position);
+}
+
+unsigned text_type, line_type, span_type, bad_char_type;
+
+void debug_handler(void* indent_level, void* message) {
+    int* indent_lvl = (int*) indent_level;
+    int i, imax;
+    for (i = 0, imax = *indent_lvl; i < imax; ++i)
+        fputs("  ", stderr);
+
+    if (message == NULL)
+        fputs("??? (no memory available)", stderr);
+    else
+        diagctx_render(indent_level, message);
+    fputc('\n', stderr);
+    ++*indent_lvl;
+}
+
+jmp_buf error_handling_jmp;
+
+/* Called by DIAGCTX_FAIL(), outside of the hot path of the functions below. */
+void report_error(void* userdata, int severity, char const* text, char const* file, int line) {
+    int indent_level = 1;
+    (void) userdata; (void) file; (void) line;
+    fprintf(stderr, "%s %s\n", severity == DIAGCTX_ERROR ? "ERROR!" : "WARNING!", text);
+    diagctx_get(-1, debug_handler, &indent_level);
+    if (severity == DIAGCTX_ERROR)
+        longjmp(error_handling_jmp, 1);
+}
+
+/* Expected messages of resize_buffer(): the ones from 'nb_stored' were dropped, so they are NULL. */
+typedef struct {
+    int index;
+    int nb_stored;
+    int nb_wrong;
+    int indent_level;
+} ResizeCheck;
+
+void check_handler(void* userdata, void* message) {
+    ResizeCheck* check = (ResizeCheck*) userdata;
+    static int const lines[] = {0, 0, 1, 0, 2}; /* 0 for the messages which are not lines */
+    int index = check->index++;
+    if (index >= check->nb_stored)
+        check->nb_wrong += message != NULL;
+    else if (message == NULL || diagctx_type_of(message) != (index == 3 ? span_type : lines[index] ? line_type : text_type))
+        ++check->nb_wrong;
+    else if (lines[index] != 0 && *(int*) message != lines[index])
+        ++check->nb_wrong;
+    debug_handler(&check->indent_level, message);
+}
+
+/******************** ACTUAL PROGRAM *********************/
+
+int count_uppercase_ascii(char const* str, int length) {
+    int count = 0;
+    int i;
+    unsigned msg_id;
+    Span* span = (Span*) diagctx_push_typed(span_type, &msg_id);
+    if (span != NULL) {
+        span->str = str;
+        span->length = length;
+    }
+    for (i = 0; i < length; ++i) {
+        unsigned char c = str[i];
+        if (c >= 128) {
+            /* non-ascii detected */
+            unsigned msg_id_2;
+            BadChar* bad = (BadChar*) diagctx_push_typed(bad_char_type, &msg_id_2);
+            if (bad != NULL) {
+                bad->c = c;
+                bad->position = i;
+            }
+            DIAGCTX_FAIL("non-ASCII character");
+        }
+        count += (c >= 'A' && c <= 'Z');
+    }
+    diagctx_pop(msg_id);
+    return count;
+}
+
+void for_each_line(char const* str) {
+    unsigned msg_id;
+    char const** text = (char const**) diagctx_push_typed(text_type, &msg_id);
+    int line_number = 0;
+    if (text != NULL)
+        *text = "for_each_line()";
+
+    while (1) {
+        int line_size;
+        ++line_number;
+        line_size = (int) strcspn(str, "\n");
+
+        if (setjmp(error_handling_jmp) == 0) {
+            unsigned msg_id_2;
+            int* line = (int*) diagctx_push_typed(line_type, &msg_id_2);
+            int nb_upper;
+            if (line != NULL)
+                *line = line_number;
+
+            nb_upper = count_uppercase_ascii(str, line_size);
+            printf("Line %d: %d upper characters\n", line_number, nb_upper);
+
+            diagctx_pop(msg_id_2);
+        } else {
+            /* error handling, the context was already reported by report_error() */
+            diagctx_get(msg_id, NULL, NULL);
+        }
+
+        str += line_size;
+        if (*str == '\0') break;
+        ++str; /* skipping '\n' */
+    }
+    diagctx_pop(msg_id);
+}
+
+/* Move the messages to a larger buffer, then to a smaller one where only the first two fit.
+ * '*buffer' is replaced by the buffer in use. Returns the number of unexpected messages. */
+int resize_buffer(void** buffer) {
+    unsigned msg_id, line_1, span_id, line_2;
+    char const** text = (char const**) diagctx_push_typed(text_type, &msg_id);
+    int* line;
+    Span* span;
+    ResizeCheck check = {0, 5, 0, 1};
+    if (text != NULL)
+        *text = "resize_buffer()";
+    if ((line = (int*) diagctx_push_typed(line_type, &line_1)) != NULL)
+        *line = 1;
+    if ((span = (Span*) diagctx_push_typed(span_type, &span_id)) != NULL) {
+        span->str = "ABC";
+        span->length = 3;
+    }
+    if ((line = (int*) diagctx_push_typed(line_type, &line_2)) != NULL)
+        *line = 2;
+
+    free(diagctx_resize(*buffer = malloc(1024), 1024, NULL));
+    fputs("Moved to 1024 bytes:\n", stderr);
+    diagctx_get(-1, check_handler, &check);
+
+    /* The headers and the payloads of the first two messages take less than 96 bytes, not the third. */
+    free(diagctx_resize(*buffer = malloc(96), 96, NULL));
+    fputs("Moved to 96 bytes:\n", stderr);
+    check.index = 0;
+    check.nb_stored = 2;
+    check.indent_level = 1;
+    diagctx_get(-1, check_handler, &check);
+
+    diagctx_pop(line_2);
+    diagctx_pop(span_id);
+    diagctx_pop(line_1);
+    diagctx_pop(msg_id);
+    return check.nb_wrong;
+}
+
+int main() {
+    unsigned buffer_size = 256;
+    void* buffer = malloc(buffer_size);
+    unsigned msg_id;
+    char const** text;
+
+    text_type = diagctx_register_type("text", sizeof(char const*), NULL, render_text);
+    line_type = diagctx_register_type("line", sizeof(int), NULL, render_line);
+    span_type = diagctx_register_type("span", sizeof(Span), NULL, render_span);
+    bad_char_type = diagctx_register_type("bad char", sizeof(BadChar), NULL, render_bad_char);
+
+    diagctx_init_typed(buffer, buffer_size);
+    diagctx_set_report(report_error, NULL);
+
+    text = (char const**) diagctx_push_typed(text_type, &msg_id);
+    if (text != NULL)
+        *text = "main()";
+
+    for_each_line("Hello World!\n"
+                  "ABC def GHI jlk\n"
+                  "Hello \x86 World!\n"
+                  "\x97 te\\st\n"
+                  "\x80\x81\x82\n"
+                  "THE END!");
+
+    if (resize_buffer(&buffer) != 0) {
+        fputs("diagctx_resize() did not keep the expected messages\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    diagctx_pop(msg_id);
+    free(buffer);
+    return 0;
+}
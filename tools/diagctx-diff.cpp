@@ -0,0 +1,183 @@
+// Compare two profiles written by diagctx_profile_dump(), for instance of two builds of the same program,
+// and report which context paths got slower or allocate more.
+// Paths are aligned by fingerprint, which only depends on the type names of the path.
+// The mean time per message is compared with Welch's t-test, using the count, total and sum of squares
+// of each path. Allocations per message are compared without test, as they are usually deterministic.
+// For the paths whose resource usage was sampled (see diagctx_profile_usage()), a second table shows
+// the share of the time spent on the CPU, and the page faults and context switches per message,
+// to tell whether a slower path computes more, faults more pages or waits more.
+// Build and run:
+//     g++ -std=c++17 -O2 tools/diagctx-diff.cpp -o diagctx-diff && ./diagctx-diff before.txt after.txt
+// Options:
+//   --alpha=P          significance level of the t-test (default: 0.01)
+//   --min-change=PCT   smallest relative change reported as a regression or improvement (default: 5)
+// Exits with 1 if a path regressed (significantly slower, or more bytes allocated per message), 2 on errors.
+
+#include "profile_reader.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+using profile_reader::path_stats;
+
+/************ Student's t distribution ************/
+
+// Continued fraction of the regularized incomplete beta function (modified Lentz's method).
+double beta_fraction(double a, double b, double x) {
+    double const tiny = 1e-300;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    d = 1 / (std::fabs(d) < tiny ? tiny : d);
+    double h = d;
+    for (int m = 1; m <= 300; ++m) {
+        for (int step = 0; step < 2; ++step) {
+            double num = step == 0 ? m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+                                   : -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+            d = 1 + num * d;
+            d = 1 / (std::fabs(d) < tiny ? tiny : d);
+            c = 1 + num / c;
+            c = std::fabs(c) < tiny ? tiny : c;
+            h *= d * c;
+        }
+        if (std::fabs(d * c - 1) < 1e-12)
+            break;
+    }
+    return h;
+}
+
+double incomplete_beta(double a, double b, double x) {
+    if (x <= 0 || x >= 1)
+        return x <= 0 ? 0 : 1;
+    double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log1p(-x));
+    if (x < (a + 1) / (a + b + 2))
+        return front * beta_fraction(a, b, x) / a;
+    return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+// Two-sided p-value of Welch's t-test, 1 when it cannot be computed.
+double welch_p_value(path_stats const& before, path_stats const& after) {
+    if (before.count < 2 || after.count < 2)
+        return 1;
+    double v1 = before.variance() / before.count, v2 = after.variance() / after.count;
+    if (v1 + v2 <= 0)
+        return before.mean() == after.mean() ? 1 : 0;
+    double t = (after.mean() - before.mean()) / std::sqrt(v1 + v2);
+    double df = (v1 + v2) * (v1 + v2) / (v1 * v1 / (before.count - 1) + v2 * v2 / (after.count - 1));
+    return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+/************ report ************/
+
+struct row {
+    std::string status, path;
+    double time_change = 0, p_value = 1, alloc_change = 0;
+    double mean_before = 0, mean_after = 0, bytes_before = 0, bytes_after = 0;
+    path_stats before, after; // for the resource usage
+};
+
+double relative_change(double before, double after) {
+    if (before == 0)
+        return after == 0 ? 0 : HUGE_VAL;
+    return (after - before) / before * 100;
+}
+
+int status_order(std::string const& status) {
+    static char const* const order[] = {"slower", "allocates more", "faster", "allocates less", "added", "removed", ""};
+    for (int i = 0; i < 6; ++i)
+        if (status == order[i])
+            return i;
+    return 6;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    double alpha = 0.01, min_change = 5;
+    std::vector<char const*> files;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--alpha=", 8) == 0)
+            alpha = std::atof(argv[i] + 8);
+        else if (std::strncmp(argv[i], "--min-change=", 13) == 0)
+            min_change = std::atof(argv[i] + 13);
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.size() != 2) {
+        std::fprintf(stderr, "usage: diagctx-diff [--alpha=P] [--min-change=PCT] before.txt after.txt\n");
+        return 2;
+    }
+    profile_reader::profile before, after;
+    if (!profile_reader::read_profile("diagctx-diff", files[0], before) ||
+        !profile_reader::read_profile("diagctx-diff", files[1], after))
+        return 2;
+
+    std::vector<row> rows;
+    for (auto const& [fingerprint, stats] : before) {
+        row r;
+        r.path = stats.path;
+        r.mean_before = stats.mean();
+        r.bytes_before = stats.bytes_per_message();
+        r.before = stats;
+        auto it = after.find(fingerprint);
+        if (it == after.end()) {
+            r.status = "removed";
+        } else {
+            path_stats const& other = it->second;
+            r.after = other;
+            r.mean_after = other.mean();
+            r.bytes_after = other.bytes_per_message();
+            r.time_change = relative_change(r.mean_before, r.mean_after);
+            r.alloc_change = relative_change(r.bytes_before, r.bytes_after);
+            r.p_value = welch_p_value(stats, other);
+            if (r.p_value < alpha && std::fabs(r.time_change) >= min_change)
+                r.status = r.time_change > 0 ? "slower" : "faster";
+            else if (std::fabs(r.alloc_change) >= min_change)
+                r.status = r.alloc_change > 0 ? "allocates more" : "allocates less";
+        }
+        rows.push_back(r);
+    }
+    for (auto const& [fingerprint, stats] : after) {
+        if (before.count(fingerprint) == 0) {
+            row r;
+            r.status = "added";
+            r.path = stats.path;
+            r.mean_after = stats.mean();
+            r.bytes_after = stats.bytes_per_message();
+            r.after = stats;
+            rows.push_back(r);
+        }
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](row const& a, row const& b) {
+        if (status_order(a.status) != status_order(b.status))
+            return status_order(a.status) < status_order(b.status);
+        return std::fabs(a.time_change) > std::fabs(b.time_change);
+    });
+
+    bool regressed = false;
+    std::printf("%-15s %12s %12s %8s %9s %12s %12s %8s  %s\n", "status", "ticks before", "ticks after", "change",
+                "p-value", "B/msg before", "B/msg after", "change", "path");
+    for (row const& r : rows) {
+        regressed |= r.status == "slower" || r.status == "allocates more";
+        std::printf("%-15s %12.1f %12.1f %7.1f%% %9.2g %12.1f %12.1f %7.1f%%  %s\n", r.status.empty() ? "-" : r.status.c_str(),
+                    r.mean_before, r.mean_after, r.time_change, r.p_value, r.bytes_before, r.bytes_after, r.alloc_change,
+                    r.path.c_str());
+    }
+
+    bool header = false;
+    for (row const& r : rows) {
+        if (r.before.usage_count == 0 && r.after.usage_count == 0)
+            continue;
+        if (!header) {
+            std::printf("\n%10s %10s %13s %13s %13s %13s  %s\n", "CPU before", "CPU after", "faults before",
+                        "faults after", "switch before", "switch after", "path (usage per message)");
+            header = true;
+        }
+        std::printf("%9.1f%% %9.1f%% %13.2f %13.2f %13.2f %13.2f  %s\n", r.before.cpu_share() * 100,
+                    r.after.cpu_share() * 100, r.before.faults_per_message(), r.after.faults_per_message(),
+                    r.before.switches_per_message(), r.after.switches_per_message(), r.path.c_str());
+    }
+    return regressed ? 1 : 0;
+}
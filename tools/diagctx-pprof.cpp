@@ -0,0 +1,377 @@
+// Convert profiles written by diagctx_profile_dump() to the pprof format (gzip-compressed profile.proto),
+// to view them with pprof and the tools which read its format.
+// Each type name of the context paths becomes a synthetic function (with one location), and each path
+// becomes a sample whose stack is its type names, from the last message to the first one.
+// Sample values: count (messages popped), time (ticks spent in the path itself, without its nested paths),
+// alloc_objects and alloc_space (allocations reported with diagctx_profile_alloc()), and for the paths
+// whose usage was sampled, cpu, page_faults and context_switches (in the path itself, like time).
+// The protobuf and gzip encoders are written here, without dependency: deflate uses the fixed Huffman codes
+// with LZ77 matches, which compresses the repetitive string table and samples well enough.
+// Build and run:
+//     g++ -std=c++17 -O2 tools/diagctx-pprof.cpp -o diagctx-pprof
+//     ./diagctx-pprof -o profile.pb.gz profile.txt [more dumps...] && pprof -top profile.pb.gz
+// Options:
+//   -o FILE          output file (default: profile.pb.gz)
+//   --unit=UNIT      unit of the clock ticks (default: nanoseconds)
+
+#include "profile_reader.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+/************ protobuf encoding ************/
+
+class proto_writer {
+public:
+    void varint(std::uint64_t value) {
+        while (value >= 0x80) {
+            m_out += (char) (value | 0x80);
+            value >>= 7;
+        }
+        m_out += (char) value;
+    }
+
+    void uint_field(int field, std::uint64_t value) {
+        if (value == 0)
+            return; // default value, omitted
+        varint((std::uint64_t) field << 3); // wire type 0: varint
+        varint(value);
+    }
+
+    void bytes_field(int field, std::string const& bytes) {
+        varint((std::uint64_t) field << 3 | 2); // wire type 2: length-delimited
+        varint(bytes.size());
+        m_out += bytes;
+    }
+
+    void message_field(int field, proto_writer const& message) { bytes_field(field, message.m_out); }
+
+    void packed_field(int field, std::vector<std::uint64_t> const& values) {
+        proto_writer packed;
+        for (std::uint64_t value : values)
+            packed.varint(value);
+        bytes_field(field, packed.m_out);
+    }
+
+    std::string const& bytes() const { return m_out; }
+
+private:
+    std::string m_out;
+};
+
+/************ gzip encoding ************/
+
+std::uint32_t crc32(std::string const& data) {
+    static std::uint32_t table[256];
+    if (table[1] == 0) {
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (unsigned char byte : data)
+        crc = table[(crc ^ byte) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+class bit_writer {
+public:
+    explicit bit_writer(std::string& out) : m_out(out) {}
+
+    // Deflate packs values from the least significant bit.
+    void put(std::uint32_t value, int nb_bits) {
+        m_bits |= value << m_count;
+        m_count += nb_bits;
+        while (m_count >= 8) {
+            m_out += (char) (m_bits & 0xFF);
+            m_bits >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    // Huffman codes are packed from the most significant bit.
+    void put_code(std::uint32_t code, int nb_bits) {
+        std::uint32_t reversed = 0;
+        for (int i = 0; i < nb_bits; ++i)
+            reversed |= ((code >> i) & 1) << (nb_bits - 1 - i);
+        put(reversed, nb_bits);
+    }
+
+    void flush() {
+        if (m_count > 0)
+            m_out += (char) m_bits;
+        m_bits = 0;
+        m_count = 0;
+    }
+
+private:
+    std::string& m_out;
+    std::uint32_t m_bits = 0;
+    int m_count = 0;
+};
+
+void put_literal(bit_writer& bits, unsigned symbol) {
+    if (symbol < 144)
+        bits.put_code(0x30 + symbol, 8);
+    else if (symbol < 256)
+        bits.put_code(0x190 + symbol - 144, 9);
+    else if (symbol < 280)
+        bits.put_code(symbol - 256, 7);
+    else
+        bits.put_code(0xC0 + symbol - 280, 8);
+}
+
+void put_match(bit_writer& bits, unsigned length, unsigned distance) {
+    static unsigned const length_base[] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                           31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static unsigned const length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                            2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static unsigned const distance_base[] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,
+                                             33,  49,  65,  97,  129, 193,  257,  385,  513,  769,
+                                             1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static unsigned const distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                              6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    unsigned code = 28;
+    while (length_base[code] > length)
+        --code;
+    put_literal(bits, 257 + code);
+    bits.put(length - length_base[code], (int) length_extra[code]);
+    code = 29;
+    while (distance_base[code] > distance)
+        --code;
+    bits.put_code(code, 5);
+    bits.put(distance - distance_base[code], (int) distance_extra[code]);
+}
+
+// One deflate block with the fixed Huffman codes, and LZ77 matches found with hash chains.
+std::string deflate_fixed(std::string const& data) {
+    constexpr unsigned window = 32768, max_chain = 64, min_match = 3, max_match = 258;
+    std::string out;
+    bit_writer bits(out);
+    bits.put(1, 1); // last block
+    bits.put(1, 2); // fixed Huffman codes
+
+    std::vector<int> head(1 << 15, -1), previous(window, -1);
+    auto hash = [&data](std::size_t pos) {
+        return (((unsigned char) data[pos] << 10) ^ ((unsigned char) data[pos + 1] << 5) ^
+                (unsigned char) data[pos + 2]) & 0x7FFF;
+    };
+    auto insert = [&](std::size_t pos) {
+        if (pos + min_match <= data.size()) {
+            unsigned h = hash(pos);
+            previous[pos % window] = head[h];
+            head[h] = (int) pos;
+        }
+    };
+
+    std::size_t pos = 0;
+    while (pos < data.size()) {
+        unsigned best_length = 0, best_distance = 0;
+        if (pos + min_match <= data.size()) {
+            int candidate = head[hash(pos)];
+            std::size_t limit = std::min<std::size_t>(max_match, data.size() - pos);
+            for (unsigned chain = 0; candidate >= 0 && pos - candidate <= window - 1 && chain < max_chain; ++chain) {
+                unsigned length = 0;
+                while (length < limit && data[candidate + length] == data[pos + length])
+                    ++length;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = (unsigned) (pos - candidate);
+                    if (length == limit)
+                        break;
+                }
+                int next = previous[candidate % window];
+                if (next >= candidate)
+                    break; // overwritten by a more recent position
+                candidate = next;
+            }
+        }
+        if (best_length >= min_match) {
+            put_match(bits, best_length, best_distance);
+            for (unsigned i = 0; i < best_length; ++i)
+                insert(pos + i);
+            pos += best_length;
+        } else {
+            put_literal(bits, (unsigned char) data[pos]);
+            insert(pos);
+            ++pos;
+        }
+    }
+    put_literal(bits, 256); // end of block
+    bits.flush();
+    return out;
+}
+
+std::string gzip(std::string const& data) {
+    std::string out = {'\x1f', '\x8b', 8 /* deflate */, 0 /* flags */, 0, 0, 0, 0 /* mtime */, 0, '\xff' /* OS */};
+    out += deflate_fixed(data);
+    for (std::uint32_t value : {crc32(data), (std::uint32_t) data.size()})
+        for (int i = 0; i < 4; ++i)
+            out += (char) (value >> (8 * i));
+    return out;
+}
+
+/************ profile.proto ************/
+
+class string_table {
+public:
+    string_table() { index(""); }
+
+    std::uint64_t index(std::string const& str) {
+        auto it = m_indices.find(str);
+        if (it != m_indices.end())
+            return it->second;
+        m_strings.push_back(str);
+        return m_indices[str] = m_strings.size() - 1;
+    }
+
+    std::vector<std::string> const& strings() const { return m_strings; }
+
+private:
+    std::map<std::string, std::uint64_t> m_indices;
+    std::vector<std::string> m_strings;
+};
+
+// Returns false if the stack of a path does not contain all its frames, with an error on stderr.
+bool encode_profile(profile_reader::profile const& profile, std::string const& unit, std::string& encoded) {
+    // Time of the path itself: its total minus the totals of its nested paths.
+    // The usage is similarly attributed to the path itself, nested paths which are not sampled included.
+    struct self_values {
+        double time = 0, cpu = 0, faults = 0, switches = 0;
+    };
+    std::map<std::string, self_values> self;
+    for (auto const& entry : profile) {
+        profile_reader::path_stats const& stats = entry.second;
+        self_values& values = self[stats.path];
+        values.time += stats.total;
+        values.cpu += stats.cpu_time;
+        values.faults += stats.minor_faults + stats.major_faults;
+        values.switches += stats.voluntary_switches + stats.involuntary_switches;
+    }
+    for (auto const& entry : profile) {
+        profile_reader::path_stats const& stats = entry.second;
+        std::size_t separator = stats.path.rfind(';');
+        if (separator == std::string::npos)
+            continue;
+        auto parent = self.find(stats.path.substr(0, separator));
+        if (parent != self.end()) {
+            parent->second.time -= stats.total;
+            parent->second.cpu -= stats.cpu_time;
+            parent->second.faults -= stats.minor_faults + stats.major_faults;
+            parent->second.switches -= stats.voluntary_switches + stats.involuntary_switches;
+        }
+    }
+
+    string_table strings;
+    proto_writer out;
+    for (auto const& [type, type_unit] : {std::pair<char const*, char const*>{"count", "count"},
+                                          {"time", unit.c_str()},
+                                          {"alloc_objects", "count"},
+                                          {"alloc_space", "bytes"},
+                                          {"cpu", "nanoseconds"},
+                                          {"page_faults", "count"},
+                                          {"context_switches", "count"}}) {
+        proto_writer value_type;
+        value_type.uint_field(1, strings.index(type));
+        value_type.uint_field(2, strings.index(type_unit));
+        out.message_field(1, value_type); // sample_type
+    }
+
+    std::map<std::string, std::uint64_t> function_ids; // by type name
+    for (auto const& entry : profile) {
+        std::string const& path = entry.second.path;
+        std::vector<std::uint64_t> location_ids;
+        std::string stack; // names of the locations, from the first message, to check the stack
+        for (std::size_t end = path.size();;) {
+            std::size_t start = end == 0 ? std::string::npos : path.rfind(';', end - 1);
+            start = start == std::string::npos ? 0 : start + 1;
+            std::string name = path.substr(start, end - start);
+            stack.insert(0, location_ids.empty() ? name : name + ";");
+            auto it = function_ids.find(name);
+            std::uint64_t id = it != function_ids.end() ? it->second : function_ids.size() + 1;
+            function_ids.emplace(name, id);
+            location_ids.push_back(id); // from the last message to the first one
+            if (start == 0)
+                break;
+            end = start - 1;
+        }
+        if (stack != path) {
+            std::fprintf(stderr, "diagctx-pprof: the stack '%s' misses frames of the path '%s'\n", stack.c_str(),
+                         path.c_str());
+            return false;
+        }
+        self_values const& values_of_path = self[path];
+        std::vector<std::uint64_t> values = {
+            (std::uint64_t) entry.second.count, (std::uint64_t) std::max(0.0, values_of_path.time),
+            (std::uint64_t) entry.second.alloc_count, (std::uint64_t) entry.second.alloc_bytes,
+            (std::uint64_t) std::max(0.0, values_of_path.cpu), (std::uint64_t) std::max(0.0, values_of_path.faults),
+            (std::uint64_t) std::max(0.0, values_of_path.switches)};
+        proto_writer sample;
+        sample.packed_field(1, location_ids);
+        sample.packed_field(2, values);
+        out.message_field(2, sample);
+    }
+
+    for (auto const& [name, id] : function_ids) {
+        proto_writer line, location, function;
+        line.uint_field(1, id); // function_id
+        location.uint_field(1, id);
+        location.message_field(4, line);
+        out.message_field(4, location);
+        function.uint_field(1, id);
+        function.uint_field(2, strings.index(name));
+        function.uint_field(3, strings.index(name));
+        out.message_field(5, function);
+    }
+
+    std::uint64_t time_field = strings.index("time");
+    for (std::string const& str : strings.strings())
+        out.bytes_field(6, str); // string_table, the empty string first
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    out.uint_field(9, (std::uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    out.uint_field(14, time_field); // default_sample_type
+    encoded = out.bytes();
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string output = "profile.pb.gz", unit = "nanoseconds";
+    std::vector<char const*> files;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (std::strncmp(argv[i], "--unit=", 7) == 0)
+            unit = argv[i] + 7;
+        else
+            files.push_back(argv[i]);
+    }
+    if (files.empty()) {
+        std::fprintf(stderr, "usage: diagctx-pprof [-o profile.pb.gz] [--unit=UNIT] profile.txt...\n");
+        return 2;
+    }
+    profile_reader::profile profile;
+    for (char const* file : files)
+        if (!profile_reader::read_profile("diagctx-pprof", file, profile))
+            return 2;
+
+    std::string encoded;
+    if (!encode_profile(profile, unit, encoded))
+        return 2;
+    std::string compressed = gzip(encoded);
+    std::FILE* file = std::fopen(output.c_str(), "wb");
+    if (file == nullptr || std::fwrite(compressed.data(), 1, compressed.size(), file) != compressed.size()) {
+        std::fprintf(stderr, "diagctx-pprof: cannot write '%s'\n", output.c_str());
+        return 2;
+    }
+    std::fclose(file);
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Reader of the profiles written by diagctx_profile_dump(), shared by the tools (C++17, no dependency).
+
+#ifndef DIAGCTX_TOOLS_PROFILE_READER
+#define DIAGCTX_TOOLS_PROFILE_READER
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+namespace profile_reader {
+
+struct path_stats {
+    std::string path; // type names separated by ';', from the first message
+    double count = 0, total = 0, total_squares = 0, alloc_count = 0, alloc_bytes = 0;
+    // Resource usage of the messages whose type is sampled by diagctx_profile_usage(), 0 in version 1.
+    double usage_count = 0, cpu_time = 0, minor_faults = 0, major_faults = 0, voluntary_switches = 0,
+           involuntary_switches = 0;
+
+    double mean() const { return count > 0 ? total / count : 0; }
+    double variance() const {
+        return count > 1 ? std::max(0.0, (total_squares - total * total / count) / (count - 1)) : 0;
+    }
+    double bytes_per_message() const { return count > 0 ? alloc_bytes / count : 0; }
+    // Share of the time spent on the CPU, if the clock and the sampler have the same unit.
+    double cpu_share() const { return usage_count > 0 && total > 0 ? cpu_time / total : 0; }
+    double faults_per_message() const { return usage_count > 0 ? (minor_faults + major_faults) / usage_count : 0; }
+    double switches_per_message() const {
+        return usage_count > 0 ? (voluntary_switches + involuntary_switches) / usage_count : 0;
+    }
+};
+
+using profile = std::map<std::string, path_stats>; // by fingerprint
+
+// Add the paths of 'filename' to 'out'. Lines of the same fingerprint, such as the dumps
+// of several threads or files, are merged. Errors are printed on stderr, prefixed by 'tool'.
+inline bool read_profile(char const* tool, char const* filename, profile& out) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::fprintf(stderr, "%s: cannot open '%s'\n", tool, filename);
+        return false;
+    }
+    std::string line;
+    int version = 1;
+    for (int line_number = 1; std::getline(file, line); ++line_number) {
+        if (line.rfind("# diagctx profile ", 0) == 0)
+            version = std::atoi(line.c_str() + 18);
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        std::string fingerprint;
+        path_stats stats;
+        fields >> fingerprint >> stats.count >> stats.total >> stats.total_squares >> stats.alloc_count >>
+            stats.alloc_bytes;
+        if (version >= 2)
+            fields >> stats.usage_count >> stats.cpu_time >> stats.minor_faults >> stats.major_faults >>
+                stats.voluntary_switches >> stats.involuntary_switches;
+        // The path is the rest of the line, as type names may contain spaces.
+        if (!fields || fields.get() != ' ' || !std::getline(fields, stats.path) || stats.path.empty()) {
+            std::fprintf(stderr, "%s: %s:%d: invalid line\n", tool, filename, line_number);
+            return false;
+        }
+        path_stats& merged = out[fingerprint];
+        merged.path = stats.path;
+        merged.count += stats.count;
+        merged.total += stats.total;
+        merged.total_squares += stats.total_squares;
+        merged.alloc_count += stats.alloc_count;
+        merged.alloc_bytes += stats.alloc_bytes;
+        merged.usage_count += stats.usage_count;
+        merged.cpu_time += stats.cpu_time;
+        merged.minor_faults += stats.minor_faults;
+        merged.major_faults += stats.major_faults;
+        merged.voluntary_switches += stats.voluntary_switches;
+        merged.involuntary_switches += stats.involuntary_switches;
+    }
+    return true;
+}
+
+} // namespace profile_reader
+
+#endif